@@ -0,0 +1,183 @@
+#!/bin/bash
+
+# Benchmark and regression suite for 8bit.
+# Generates sine sweeps and noise as wav/flac/mp3/aac/opus, converts each
+# with every mode, and appends the speed, CPU time, peak RSS and output
+# checksum of each conversion to a results file. The run is then compared
+# with the previous one in that file.
+# Usage: 8bit-bench.sh [SECONDS]
+# Environment:
+#   EIGHTBIT   the 8bit binary (default: ./8bit)
+#   RESULTS    the results file (default: 8bit-bench.tsv)
+#   INPUTS     where generated inputs are kept between runs
+#              (default: $TMPDIR/8bit-bench)
+#   MODES      space-separated modes to run, any of soxr, fast, pipeline
+#              (default: soxr fast)
+
+# 8bit-bench.sh
+# Copyright (C) 2021 Zhang Maiyun <me@maiyun.me>
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+set -e
+
+eightbit="${EIGHTBIT:-./8bit}"
+results="${RESULTS:-8bit-bench.tsv}"
+inputs="${INPUTS:-${TMPDIR:-/tmp}/8bit-bench}"
+modes="${MODES:-soxr fast}"
+duration="${1:-600}"
+workdir="$(mktemp -d)"
+trap 'rm -rf "$workdir"' EXIT
+
+run="$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+commit="$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || echo -)"
+ffversion="$(ffmpeg -version | awk 'NR == 1 { print $3 }')"
+
+# Signals: name and aevalsrc/anoisesrc source at the given rate
+signal_source() {
+    case "$1" in
+        sweep)
+            echo "aevalsrc=0.5*sin(2*PI*(50*t+3950/(2*$duration)*t*t))|0.5*sin(2*PI*440*t):s=$2:d=$duration"
+            ;;
+        noise)
+            echo "anoisesrc=c=pink:a=0.3:seed=42:r=$2:d=$duration,pan=stereo|c0=c0|c1=c0"
+            ;;
+    esac
+}
+
+# Formats: extension, encoder and options
+format_args() {
+    case "$1" in
+        wav) echo "pcm_s16le" ;;
+        flac) echo "flac" ;;
+        mp3) echo "libmp3lame -b:a 192k" ;;
+        aac) echo "aac -b:a 160k" ;;
+        opus) echo "libopus -b:a 128k" ;;
+    esac
+}
+
+# Make the input unless an earlier run already did
+make_input() {
+    local signal="$1" rate="$2" format="$3" file encoder
+    file="$inputs/$signal-$rate-$duration.$format"
+    if [ ! -s "$file" ]
+    then
+        read -r encoder _ <<<"$(format_args "$format")"
+        if ! ffmpeg -hide_banner -encoders 2>/dev/null | grep -q " $encoder "
+        then
+            echo "$format: encoder $encoder not available, skipping" >&2
+            return 1
+        fi
+        mkdir -p "$inputs"
+        # shellcheck disable=SC2046
+        ffmpeg -loglevel error -f lavfi -i "$(signal_source "$signal" "$rate")" \
+            -c:a $(format_args "$format") "$file.tmp.$format" || return 1
+        mv "$file.tmp.$format" "$file"
+    fi
+    echo "$file"
+}
+
+# Run one conversion and print "wall cpu maxrss status" (seconds, seconds,
+# KiB, exit status)
+measure() {
+    local status=0
+    if [ -x /usr/bin/time ] && /usr/bin/time -f "" true 2>/dev/null
+    then
+        /usr/bin/time -o "$workdir/time" -f "%e %U %S %M" "$@" || status=$?
+        awk -v s="$status" '{ printf "%s %.2f %s %s\n", $1, $2 + $3, $4, s }' "$workdir/time"
+    else
+        # No GNU time, so no peak RSS either
+        local TIMEFORMAT="%R %U %S"
+        { time "$@" 2>"$workdir/stderr" || status=$?; } 2>"$workdir/time"
+        cat "$workdir/stderr" >&2
+        awk -v s="$status" '{ printf "%s %.2f - %s\n", $1, $2 + $3, s }' "$workdir/time"
+    fi
+}
+
+if [ ! -s "$results" ]
+then
+    printf "run\tcommit\tffmpeg\tinput\tmode\tseconds\twall\trealtime\tcpu\tmaxrss_kb\toutput_sha256\tinput_sha256\n" >"$results"
+fi
+
+for signal in sweep noise
+do
+    # The sweep exercises the 44.1 kHz path, the noise the 48 kHz one
+    rate=44100
+    [ "$signal" = noise ] && rate=48000
+    for format in wav flac mp3 aac opus
+    do
+        # Opus is always decoded at 48 kHz
+        [ "$format" = opus ] && [ "$rate" != 48000 ] && continue
+        input="$(make_input "$signal" "$rate" "$format")" || continue
+        input_sum="$(sha256sum "$input" | cut -c1-16)"
+        for mode in $modes
+        do
+            case "$mode" in
+                soxr) flag="" ;;
+                fast) flag="-f" ;;
+                pipeline) flag="-p" ;;
+                *)
+                    echo "unknown mode $mode" >&2
+                    exit 1
+                    ;;
+            esac
+            output="$workdir/out-$mode.raw"
+            # shellcheck disable=SC2086
+            read -r wall cpu rss status <<<"$(measure "$eightbit" $flag "$input" "$output")"
+            if [ "$status" != 0 ]
+            then
+                echo "$(basename "$input") $mode: 8bit exited with status $status" >&2
+                continue
+            fi
+            speed="$(awk -v d="$duration" -v w="$wall" 'BEGIN { printf "%.1f", (w > 0 ? d / w : 0) }')"
+            output_sum="$(sha256sum "$output" | cut -c1-16)"
+            printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+                "$run" "$commit" "$ffversion" "$(basename "$input")" "$mode" \
+                "$duration" "$wall" "$speed" "$cpu" "$rss" "$output_sum" \
+                "$input_sum" >>"$results"
+        done
+        # soxr and fast should be close; print the largest sample difference
+        if [ -f "$workdir/out-soxr.raw" ] && [ -f "$workdir/out-fast.raw" ]
+        then
+            cmp -l "$workdir/out-soxr.raw" "$workdir/out-fast.raw" 2>/dev/null |
+                awk -v input="$(basename "$input")" \
+                    'function abs(x) { return x < 0 ? -x : x }
+                     function oct(s,    n, i) { for (i = 1; i <= length(s); ++i) n = n * 8 + substr(s, i, 1); return n }
+                     { d = abs(oct($2) - oct($3)); if (d > m) m = d }
+                     END { printf "%s: max soxr/fast difference: %d\n", input, m }'
+        fi
+        rm -f "$workdir"/out-*.raw
+    done
+done
+
+# Compare with the previous run of the same length
+awk -F '\t' -v run="$run" -v duration="$duration" '
+    NR == 1 || $6 != duration { next }
+    $1 != run { if ($1 != last) { prev = $1; delete old; delete oldsum; delete oldin }
+                last = $1; key = $4 "\t" $5
+                old[key] = $8; oldsum[key] = $11; oldin[key] = $12; next }
+    {
+        key = $4 "\t" $5
+        line = sprintf("%-24s %-8s %8sx  cpu %7ss  rss %7s KiB", $4, $5, $8, $9, $10)
+        if (key in old)
+        {
+            change = old[key] > 0 ? 100 * ($8 - old[key]) / old[key] : 0
+            line = line sprintf("  %+6.1f%% vs %s", change, prev)
+            if (oldin[key] != $12)
+                line = line "  input changed"
+            else if (oldsum[key] != $11)
+                line = line "  OUTPUT CHANGED"
+        }
+        print line
+    }' "$results"
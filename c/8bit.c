@@ -17,6 +17,9 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libavcodec/avcodec.h>
 #include <libavfilter/avfilter.h>
@@ -25,9 +28,26 @@
 #include <libavformat/avformat.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 /* Verbose printer */
 #define v_printf(...)                                                          \
@@ -40,17 +60,45 @@
 #define averror(message) av_log(NULL, AV_LOG_ERROR, "%s\n", (message))
 
 #define DST_SAMPLE_RATE 8000
+/* Minimum size of the output ring buffer */
+#define RING_SIZE (4 << 20)
+/* Number of frames each pipeline queue can hold */
+#define QUEUE_SIZE 64
+/* Seconds decoded before each time slice in segmented mode */
+#define SEGMENT_MARGIN 1
+/* Input buffer size for memory-mapped files */
+#define MMAP_IO_SIZE (64 << 10)
+/* Input buffer and pipe size for everything else read locally */
+#define PIPE_IO_SIZE (1 << 20)
 
 static struct app_data
 {
     bool if_verbose;
+    bool writer_thread;
+    bool pipeline;
+    bool fast;
+    long segments;
     char *input_url;
-    FILE *output;
+    int output;
+    /* Batch mode */
+    char *manifest;
+    long jobs;
+    /* Daemon mode and its client */
+    char *socket_path;
+    bool daemon;
 } app_data;
 
 static const struct option LONG_OPTIONS[] = {
     {"help", no_argument, NULL, 'h'},
     {"verbose", no_argument, NULL, 'v'},
+    {"writer-thread", no_argument, NULL, 'w'},
+    {"pipeline", no_argument, NULL, 'p'},
+    {"fast", no_argument, NULL, 'f'},
+    {"segments", required_argument, NULL, 's'},
+    {"batch", required_argument, NULL, 'b'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"daemon", required_argument, NULL, 'd'},
+    {"connect", required_argument, NULL, 'c'},
     {NULL, 0, NULL, 0},
 };
 
@@ -60,10 +108,28 @@ static const char *FILTER =
 
 static void usage(const char *argv0)
 {
-    printf("Usage: %s [OPTION]... INPUT OUTPUT\n", argv0);
+    printf("Usage: %s [OPTION]... INPUT OUTPUT\n"
+           "  or:  %s [OPTION]... --batch MANIFEST\n"
+           "  or:  %s [OPTION]... --daemon SOCKET\n"
+           "  or:  %s --connect SOCKET INPUT OUTPUT\n",
+           argv0, argv0, argv0, argv0);
     puts("Resample and convert any audio to mono 8kHz 8-bit PCM.\n\n"
-         "  -v, --verbose   show detailed information to stderr\n"
-         "  -h, --help      display this help and exit");
+         "  -v, --verbose         show detailed information to stderr\n"
+         "  -w, --writer-thread   write the output from a separate thread\n"
+         "  -p, --pipeline        decode, filter and write in separate threads\n"
+         "  -f, --fast            use the built-in converter for stereo\n"
+         "                        44.1/48 kHz input instead of soxr\n"
+         "  -s, --segments=K      decode K time slices of a long input in\n"
+         "                        parallel (output must be a regular file)\n"
+         "  -b, --batch=MANIFEST  convert every \"INPUT<TAB>OUTPUT\" line of\n"
+         "                        MANIFEST\n"
+         "  -j, --jobs=N          number of parallel conversions in batch or\n"
+         "                        daemon mode (default: number of CPUs)\n"
+         "  -d, --daemon=SOCKET   stay resident and serve conversions sent to\n"
+         "                        the UNIX socket SOCKET\n"
+         "  -c, --connect=SOCKET  have the daemon at SOCKET do the conversion\n"
+         "                        of a local file or standard input\n"
+         "  -h, --help            display this help and exit");
     exit(0);
 }
 
@@ -80,16 +146,29 @@ static void parse_args(int argc, char **argv)
     {
         int option_index = 0;
         int c;
-        c = getopt_long(argc, argv, "hv", LONG_OPTIONS, &option_index);
+        c = getopt_long(argc, argv, "b:c:d:fhj:ps:vw", LONG_OPTIONS, &option_index);
         if (c == -1)
         {
-            if (optind + 2 == argc)
+            if (app_data.manifest || app_data.daemon)
+            {
+                if (optind != argc)
+                    arg_error("no input or output file expected in batch or "
+                              "daemon mode.",
+                              argv[0]);
+            }
+            else if (optind + 2 == argc)
             {
                 app_data.input_url = argv[optind];
                 if (strcmp(argv[optind + 1], "-") == 0)
-                    app_data.output = stdout;
-                else
-                    app_data.output = fopen(argv[optind + 1], "wb");
+                    app_data.output = STDOUT_FILENO;
+                else if ((app_data.output =
+                              open(argv[optind + 1],
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+                {
+                    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind + 1],
+                            strerror(errno));
+                    exit(2);
+                }
             }
             else
                 arg_error("expecting an input file and an output file.",
@@ -103,6 +182,35 @@ static void parse_args(int argc, char **argv)
             case 'v':
                 app_data.if_verbose = true;
                 break;
+            case 'w':
+                app_data.writer_thread = true;
+                break;
+            case 'p':
+                app_data.pipeline = true;
+                break;
+            case 'f':
+                app_data.fast = true;
+                break;
+            case 's':
+                if ((app_data.segments = atol(optarg)) < 1)
+                    arg_error("the number of segments must be positive.",
+                              argv[0]);
+                break;
+            case 'b':
+                app_data.manifest = optarg;
+                break;
+            case 'j':
+                if ((app_data.jobs = atol(optarg)) < 1)
+                    arg_error("the number of jobs must be positive.", argv[0]);
+                break;
+            case 'd':
+                app_data.daemon = true;
+                app_data.socket_path = optarg;
+                break;
+            case 'c':
+                app_data.daemon = false;
+                app_data.socket_path = optarg;
+                break;
             case '?':
                 /* Error message printed by getopt */
                 exit(1);
@@ -112,6 +220,246 @@ static void parse_args(int argc, char **argv)
     }
 }
 
+/* Output writer.
+ * Without a writer thread, frames are written straight from the frame
+ * buffer. Pipes are fed with vmsplice(), which needs the data to stay
+ * untouched until the reader has consumed it, so they go through a ring
+ * buffer. A writer thread uses the same ring buffer. */
+struct writer
+{
+    int fd;
+    /* Whether fd is a pipe that vmsplice() is used on. Only the thread that
+     * hands the ring to the kernel reads or clears it */
+    bool use_splice;
+    /* Capacity of the pipe, 0 for other files. Spliced data may still be in
+     * the pipe until this many more bytes have been spliced after it, which
+     * also holds for what was spliced before a fallback to write() */
+    size_t pipe_size;
+    uint8_t *ring;
+    size_t ring_size;
+    /* Stream positions. Bytes before `head` are in the ring and bytes
+     * before `tail` have been handed to the kernel */
+    size_t head, tail;
+    bool threaded;
+    bool closing;
+    int error;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* write(2) everything. Returns 0 or an errno */
+static int write_all(int fd, const uint8_t *buf, size_t n)
+{
+    while (n)
+    {
+        ssize_t written = write(fd, buf, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf += written;
+        n -= written;
+    }
+    return 0;
+}
+
+/* vmsplice(2) everything, falling back to write(2) if the kernel refuses */
+static int splice_all(struct writer *w, const uint8_t *buf, size_t n)
+{
+#ifdef __linux__
+    while (n && w->use_splice)
+    {
+        struct iovec iov = {(void *)buf, n};
+        ssize_t written = vmsplice(w->fd, &iov, 1, 0);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EINVAL && errno != ENOSYS)
+                return errno;
+            v_printf("vmsplice() unavailable, using write()\n");
+            w->use_splice = false;
+            break;
+        }
+        buf += written;
+        n -= written;
+    }
+#endif
+    return write_all(w->fd, buf, n);
+}
+
+/* Hand ring bytes [from, to) to the kernel */
+static int writer_flush_range(struct writer *w, size_t from, size_t to)
+{
+    while (from < to)
+    {
+        size_t off = from % w->ring_size;
+        size_t n = to - from;
+        int err;
+        if (n > w->ring_size - off)
+            n = w->ring_size - off;
+        err = w->use_splice ? splice_all(w, w->ring + off, n)
+                            : write_all(w->fd, w->ring + off, n);
+        if (err)
+            return err;
+        from += n;
+    }
+    return 0;
+}
+
+/* Free space in the ring */
+static size_t writer_space(const struct writer *w)
+{
+    size_t reusable = w->tail > w->pipe_size ? w->tail - w->pipe_size : 0;
+    return w->ring_size - (w->head - reusable);
+}
+
+/* Copy data into the ring, at most `limit` bytes */
+static size_t writer_fill(struct writer *w, const uint8_t *data, size_t n,
+                          size_t limit)
+{
+    size_t off = w->head % w->ring_size;
+    size_t first;
+    if (n > limit)
+        n = limit;
+    first = n < w->ring_size - off ? n : w->ring_size - off;
+    memcpy(w->ring + off, data, first);
+    memcpy(w->ring, data + first, n - first);
+    return n;
+}
+
+static void *writer_main(void *arg)
+{
+    struct writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (true)
+    {
+        size_t from = w->tail, to = w->head;
+        int err;
+        if (from == to)
+        {
+            if (w->closing)
+                break;
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+        err = writer_flush_range(w, from, to);
+        pthread_mutex_lock(&w->lock);
+        w->tail = to;
+        pthread_cond_broadcast(&w->cond);
+        if (err)
+        {
+            w->error = err;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int writer_open(struct writer *w, int fd, bool threaded)
+{
+    struct stat st;
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->threaded = threaded;
+#ifdef __linux__
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+    {
+        int size = fcntl(fd, F_GETPIPE_SZ);
+        w->use_splice = true;
+        w->pipe_size = size > 0 ? size : 65536;
+    }
+#else
+    (void)st;
+#endif
+    if (!w->use_splice && !threaded)
+        return 0;
+
+    w->ring_size = 4 * w->pipe_size > RING_SIZE ? 4 * w->pipe_size : RING_SIZE;
+    if (posix_memalign((void **)&w->ring, 4096, w->ring_size) != 0)
+        return ENOMEM;
+    if (threaded)
+    {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if ((errno = pthread_create(&w->thread, NULL, writer_main, w)) != 0)
+        {
+            pthread_cond_destroy(&w->cond);
+            pthread_mutex_destroy(&w->lock);
+            free(w->ring);
+            return errno;
+        }
+    }
+    return 0;
+}
+
+/* Returns 0 or an errno */
+static int writer_write(struct writer *w, const uint8_t *data, size_t n)
+{
+    if (!w->ring)
+        return write_all(w->fd, data, n);
+    if (!w->threaded)
+    {
+        while (n)
+        {
+            size_t done = writer_fill(w, data, n, writer_space(w));
+            int err;
+            w->head += done;
+            if ((err = writer_flush_range(w, w->tail, w->head)) != 0)
+                return err;
+            w->tail = w->head;
+            data += done;
+            n -= done;
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&w->lock);
+    while (n && !w->error)
+    {
+        size_t space = writer_space(w), done;
+        if (space == 0)
+        {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        /* The writer thread never touches the free part of the ring */
+        pthread_mutex_unlock(&w->lock);
+        done = writer_fill(w, data, n, space);
+        pthread_mutex_lock(&w->lock);
+        w->head += done;
+        pthread_cond_broadcast(&w->cond);
+        data += done;
+        n -= done;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return w->error;
+}
+
+/* Flush everything and release the writer (not the fd) */
+static int writer_close(struct writer *w)
+{
+    int err = 0;
+    if (w->threaded)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->closing = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        err = w->error;
+    }
+    free(w->ring);
+    w->ring = NULL;
+    return err;
+}
+
 #if 0
 /* Find the stream index of the n-th audio stream, where n=app_data.stream_index
  */
@@ -140,59 +488,313 @@ AVStream *find_audio_stream(AVFormatContext *fmt_ctx)
 }
 #endif
 
-int open_audio_stream(AVFormatContext **pfmt_ctx, AVCodecContext **pavc_ctx,
+/* An opened decoder kept for the next input of the same format */
+struct decoder_cache
+{
+    AVCodecContext *avc_ctx;
+    AVCodecParameters *par;
+    /* Decoder threads, 0 for automatic */
+    int threads;
+};
+
+/* Whether a decoder opened for `a` can decode `b` */
+static bool same_codecpar(const AVCodecParameters *a,
+                          const AVCodecParameters *b)
+{
+    return a->codec_id == b->codec_id && a->format == b->format &&
+           a->sample_rate == b->sample_rate && a->channels == b->channels &&
+           a->channel_layout == b->channel_layout &&
+           a->block_align == b->block_align &&
+           a->extradata_size == b->extradata_size &&
+           (a->extradata_size == 0 ||
+            memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+/* Give a decoder back to the cache, or free it without one */
+static void release_decoder(struct decoder_cache *cache,
+                            AVCodecContext **pavc_ctx, AVStream *ast)
+{
+    if (!*pavc_ctx)
+        return;
+    if (cache && ast)
+    {
+        avcodec_free_context(&cache->avc_ctx);
+        if (!cache->par && !(cache->par = avcodec_parameters_alloc()))
+        {
+            avcodec_free_context(pavc_ctx);
+            return;
+        }
+        if (avcodec_parameters_copy(cache->par, ast->codecpar) < 0)
+        {
+            avcodec_parameters_free(&cache->par);
+            avcodec_free_context(pavc_ctx);
+            return;
+        }
+        cache->avc_ctx = *pavc_ctx;
+        *pavc_ctx = NULL;
+    }
+    else
+        avcodec_free_context(pavc_ctx);
+}
+
+static void free_decoder_cache(struct decoder_cache *cache)
+{
+    avcodec_free_context(&cache->avc_ctx);
+    avcodec_parameters_free(&cache->par);
+}
+
+/* Input read through a memory mapping of a local file, or with large
+ * read()s from a pipe or any other descriptor */
+struct input_source
+{
+    int fd;
+    /* NULL when reading with read() */
+    const uint8_t *map;
+    size_t size;
+    size_t pos;
+};
+
+static int input_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct input_source *src = opaque;
+    ssize_t n;
+    if (src->map)
+    {
+        size_t left = src->size - src->pos;
+        if (left == 0)
+            return AVERROR_EOF;
+        n = (size_t)buf_size < left ? (size_t)buf_size : left;
+        memcpy(buf, src->map + src->pos, n);
+        src->pos += n;
+        return n;
+    }
+    while ((n = read(src->fd, buf, buf_size)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return AVERROR(errno);
+    return n == 0 ? AVERROR_EOF : n;
+}
+
+static int64_t input_seek(void *opaque, int64_t offset, int whence)
+{
+    struct input_source *src = opaque;
+    int64_t pos;
+    whence &= ~AVSEEK_FORCE;
+    if (!src->map)
+    {
+        if (whence == AVSEEK_SIZE)
+        {
+            struct stat st;
+            return fstat(src->fd, &st) == 0 ? st.st_size : AVERROR(errno);
+        }
+        return (pos = lseek(src->fd, offset, whence)) < 0 ? AVERROR(errno)
+                                                            : pos;
+    }
+    switch (whence)
+    {
+        case AVSEEK_SIZE:
+            return src->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = src->pos + offset;
+            break;
+        case SEEK_END:
+            pos = src->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || (uint64_t)pos > src->size)
+        return AVERROR(EINVAL);
+    src->pos = pos;
+    return pos;
+}
+
+/* Set up an AVIOContext for a local file or pipe URL, or return NULL to
+ * leave the URL to FFmpeg */
+static AVIOContext *open_input_io(const char *input_url)
+{
+    const char *protocol = avio_find_protocol_name(input_url);
+    struct input_source *src;
+    AVIOContext *pb;
+    uint8_t *buffer;
+    struct stat st;
+    bool seekable;
+    int fd, buffer_size = PIPE_IO_SIZE;
+
+    if (!protocol)
+        return NULL;
+    if (strcmp(protocol, "file") == 0)
+    {
+        if (strncmp(input_url, "file:", 5) == 0)
+            input_url += 5;
+        if ((fd = open(input_url, O_RDONLY | O_CLOEXEC)) < 0)
+            return NULL;
+    }
+    else if (strcmp(protocol, "pipe") == 0)
+    {
+        /* "pipe:N" or "pipe:" for stdin. Not ours to close, hence dup() */
+        char *end;
+        long n = input_url[5] ? strtol(input_url + 5, &end, 10) : 0;
+        if ((input_url[5] && *end) || n < 0 ||
+            (fd = fcntl(n, F_DUPFD_CLOEXEC, 0)) < 0)
+            return NULL;
+    }
+    else
+        return NULL;
+    if (fstat(fd, &st) != 0 || !(src = calloc(1, sizeof(*src))))
+    {
+        close(fd);
+        return NULL;
+    }
+    src->fd = fd;
+    seekable = S_ISREG(st.st_mode);
+    if (seekable && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            src->map = map;
+            src->size = st.st_size;
+            /* Reads are memcpy()s, no point in a large buffer */
+            buffer_size = MMAP_IO_SIZE;
+        }
+    }
+#ifdef F_SETPIPE_SZ
+    /* Fewer wakeups per byte; fails harmlessly on anything but a pipe */
+    if (S_ISFIFO(st.st_mode))
+        fcntl(fd, F_SETPIPE_SZ, PIPE_IO_SIZE);
+#endif
+    if (!(buffer = av_malloc(buffer_size)))
+        pb = NULL;
+    else if (!(pb = avio_alloc_context(buffer, buffer_size, 0, src,
+                                       input_read, NULL,
+                                       seekable ? input_seek : NULL)))
+        av_free(buffer);
+    if (!pb)
+    {
+        if (src->map)
+            munmap((void *)src->map, src->size);
+        close(fd);
+        free(src);
+        return NULL;
+    }
+    pb->seekable = seekable ? AVIO_SEEKABLE_NORMAL : 0;
+    return pb;
+}
+
+static void close_input_io(AVIOContext **ppb)
+{
+    struct input_source *src;
+    if (!*ppb)
+        return;
+    src = (*ppb)->opaque;
+    if (src->map)
+        munmap((void *)src->map, src->size);
+    close(src->fd);
+    free(src);
+    av_freep(&(*ppb)->buffer);
+    avio_context_free(ppb);
+}
+
+/* avformat_close_input() for inputs from open_audio_stream() */
+static void close_input(AVFormatContext **pfmt_ctx)
+{
+    AVIOContext *pb;
+    if (!*pfmt_ctx)
+        return;
+    pb = (*pfmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO ? (*pfmt_ctx)->pb : NULL;
+    avformat_close_input(pfmt_ctx);
+    close_input_io(&pb);
+}
+
+int open_audio_stream(const char *input_url, struct decoder_cache *cache,
+                      AVFormatContext **pfmt_ctx, AVCodecContext **pavc_ctx,
                       AVStream **past)
 {
     AVCodec *avc = NULL;
     AVStream *ast;
     AVFormatContext *fmt_ctx = NULL;
     AVCodecContext *avc_ctx;
+    AVIOContext *pb;
     int stream_idx;
+    /* Local files and pipes are read by us, other URLs by FFmpeg */
+    if ((pb = open_input_io(input_url)))
+    {
+        if (!(fmt_ctx = avformat_alloc_context()))
+        {
+            averror("could not allocate format context");
+            close_input_io(&pb);
+            return 3;
+        }
+        fmt_ctx->pb = pb;
+        fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
     /* Open input file. URLs are supported by FFmpeg */
-    if (avformat_open_input(&fmt_ctx, app_data.input_url, NULL, NULL) != 0)
+    if (avformat_open_input(&fmt_ctx, input_url, NULL, NULL) != 0)
     {
         averror("failed to open input file");
+        /* fmt_ctx is freed, but not a custom pb */
+        close_input_io(&pb);
         return 2;
     }
     /* Parse stream information */
     if (avformat_find_stream_info(fmt_ctx, NULL) < 0)
     {
         averror("cannot find stream information");
-        avformat_close_input(&fmt_ctx);
+        close_input(&fmt_ctx);
         return 3;
     }
 
     /* Dump format information */
     if (app_data.if_verbose)
-        av_dump_format(fmt_ctx, 0, app_data.input_url, 0);
+        av_dump_format(fmt_ctx, 0, input_url, 0);
 
     /* Find an audio stream that's available to use */
     if ((stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
                                           &avc, 0)) < 0)
     {
         averror("failed to find an audio stream");
-        avformat_close_input(&fmt_ctx);
+        close_input(&fmt_ctx);
         return 3;
     }
     ast = fmt_ctx->streams[stream_idx];
+    if (cache && cache->avc_ctx && same_codecpar(cache->par, ast->codecpar))
+    {
+        /* Same format as the last input, just reset the decoder */
+        v_printf("Reusing the %s decoder\n", avc->name);
+        avc_ctx = cache->avc_ctx;
+        cache->avc_ctx = NULL;
+        avcodec_flush_buffers(avc_ctx);
+        *pfmt_ctx = fmt_ctx;
+        *past = ast;
+        *pavc_ctx = avc_ctx;
+        return 0;
+    }
     if (!(avc_ctx = avcodec_alloc_context3(avc)))
     {
         averror("could not allocate avcodec context");
-        avformat_close_input(&fmt_ctx);
+        close_input(&fmt_ctx);
         return 3;
     }
     if (avcodec_parameters_to_context(avc_ctx, ast->codecpar) < 0)
     {
         averror("could not create avcodec context");
         avcodec_free_context(&avc_ctx);
-        avformat_close_input(&fmt_ctx);
+        close_input(&fmt_ctx);
         return 3;
     }
+    /* Let the decoder use as many threads as it supports */
+    avc_ctx->thread_count = cache ? cache->threads : 0;
+    avc_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
     if (avcodec_open2(avc_ctx, avc, NULL) < 0)
     {
         averror("could not open audio decoder");
         avcodec_free_context(&avc_ctx);
-        avformat_close_input(&fmt_ctx);
+        close_input(&fmt_ctx);
         return 3;
     }
     /* Not touching the output unless everything succeeds */
@@ -202,12 +804,16 @@ int open_audio_stream(AVFormatContext **pfmt_ctx, AVCodecContext **pavc_ctx,
     return 0;
 }
 
-/* Create desired audio filters and create I/O buffers */
+/* Create desired audio filters and create I/O buffers. Input samples whose
+ * pts, counted in samples, is below trim are dropped first, unless trim is
+ * AV_NOPTS_VALUE */
 static int create_filters(AVStream *ast, AVCodecContext *avc_ctx,
+                          int64_t trim, AVFilterGraph **pfilter_graph,
                           AVFilterContext **pbuffersrc_ctx,
                           AVFilterContext **pbuffersink_ctx)
 {
     char filter_args[512];
+    char filter_spec[512];
     AVFilterGraph *filter_graph;
     AVFilterContext *buffersink_ctx = NULL;
     AVFilterContext *buffersrc_ctx = NULL;
@@ -283,7 +889,7 @@ static int create_filters(AVStream *ast, AVCodecContext *avc_ctx,
             averror("could not allocate filter input/output");
             avfilter_inout_free(&inputs);
             avfilter_inout_free(&outputs);
-            return 3;
+            goto error;
         }
         inputs->name = av_strdup("out");
         inputs->filter_ctx = buffersink_ctx;
@@ -295,8 +901,13 @@ static int create_filters(AVStream *ast, AVCodecContext *avc_ctx,
         outputs->next = NULL;
 
         /* The main functions are specified in the filter specification */
-        if (avfilter_graph_parse_ptr(filter_graph, FILTER, &inputs, &outputs,
-                                     NULL) < 0)
+        if (trim == AV_NOPTS_VALUE)
+            snprintf(filter_spec, sizeof(filter_spec), "%s", FILTER);
+        else
+            snprintf(filter_spec, sizeof(filter_spec),
+                     "atrim=start_pts=%" PRId64 ",%s", trim, FILTER);
+        if (avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs,
+                                     &outputs, NULL) < 0)
             goto error;
         if (avfilter_graph_config(filter_graph, NULL) < 0)
             goto error;
@@ -305,6 +916,7 @@ static int create_filters(AVStream *ast, AVCodecContext *avc_ctx,
         avfilter_inout_free(&outputs);
     }
 
+    *pfilter_graph = filter_graph;
     *pbuffersrc_ctx = buffersrc_ctx;
     *pbuffersink_ctx = buffersink_ctx;
     return 0;
@@ -314,125 +926,1767 @@ error:
     return 3;
 }
 
-/* Return values:
- * - 0: success
- * - 1: argument error
- * - 2: user-supplied parameters are bad
- * - 3: other internal error
- */
-int main(int argc, char **argv)
+/* Receiver of the frames produced by a stage. NULL marks the end of stream.
+ * Returns 0 on success, SINK_STOP if it wants no more frames */
+typedef int (*frame_sink)(void *opaque, AVFrame *frame);
+#define SINK_STOP (-1)
+
+/* Demux and decode the audio stream, passing every frame to `sink`,
+ * which must not keep the frame itself */
+static int decode_stream(AVFormatContext *fmt_ctx, AVCodecContext *avc_ctx,
+                         AVStream *ast, frame_sink sink, void *opaque)
 {
-    AVStream *ast = NULL;
-    AVFilterContext *buffersink_ctx = NULL;
-    AVFilterContext *buffersrc_ctx = NULL;
-    AVFormatContext *fmt_ctx = NULL;
-    AVCodecContext *avc_ctx = NULL;
-    AVFilterGraph *filter_graph = NULL;
-    AVPacket *packet = NULL;
-    AVFrame *frame = NULL, *filtered_frame = NULL;
-    int ret = 0;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    bool eof = false;
+    int ret = 3;
 
-    /* Initialization steps: parse arguments and init FFmpeg */
-    parse_args(argc, argv);
-    if (app_data.if_verbose)
-        av_log_set_level(AV_LOG_VERBOSE);
-    avformat_network_init();
+    if (!packet || !frame)
+    {
+        averror("could not allocate packet or frame");
+        goto out;
+    }
+    while (!eof)
+    {
+        int stat;
+        if (av_read_frame(fmt_ctx, packet) < 0)
+        {
+            /* Flush the decoder */
+            eof = true;
+            stat = avcodec_send_packet(avc_ctx, NULL);
+        }
+        else if (packet->stream_index == ast->index)
+            stat = avcodec_send_packet(avc_ctx, packet);
+        else
+        {
+            av_packet_unref(packet);
+            continue;
+        }
+        av_packet_unref(packet);
+        if (stat < 0)
+        {
+            averror("error while sending a packet to the decoder");
+            goto out;
+        }
+        while (true)
+        {
+            stat = avcodec_receive_frame(avc_ctx, frame);
+            if (stat == AVERROR(EAGAIN) || stat == AVERROR_EOF)
+                break;
+            if (stat < 0)
+            {
+                averror("error while receiving a frame from the decoder");
+                goto out;
+            }
+            stat = sink(opaque, frame);
+            av_frame_unref(frame);
+            if (stat != 0)
+            {
+                ret = stat == SINK_STOP ? 0 : stat;
+                goto out;
+            }
+        }
+    }
+    ret = sink(opaque, NULL);
 
-    if ((ret = open_audio_stream(&fmt_ctx, &avc_ctx, &ast)) != 0)
-        return ret;
+out:
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    return ret;
+}
 
-    if ((ret = create_filters(ast, avc_ctx, &buffersrc_ctx, &buffersink_ctx)) !=
-        0)
-        goto error;
+/* Built-in converter for stereo 44.1/48 kHz input.
+ * The channels are averaged, then a polyphase FIR (Kaiser-windowed sinc)
+ * resamples by up/down and the result is quantized like FFmpeg does for
+ * flt -> u8. The output is delayed by half the filter length so that it
+ * lines up with the input, as soxr does. */
+
+/* Taps per polyphase branch, a multiple of 8 */
+#define FAST_TAPS 480
+/* Middle of the transition band (Hz) */
+#define FAST_CUTOFF 3750.0
+/* Kaiser window beta for about 80 dB of stopband attenuation */
+#define FAST_BETA 7.857
+
+/* A supported conversion ratio and its coefficient table */
+struct fast_ratio
+{
+    int in_rate;
+    int up;
+    int down;
+    /* up branches of FAST_TAPS coefficients, each reversed so that it is
+     * a plain dot product with the input history */
+    float *coef;
+};
 
-    if (!(packet = av_packet_alloc()))
+static struct fast_ratio FAST_RATIOS[] = {
+    {44100, 80, 441, NULL},
+    {48000, 1, 6, NULL},
+};
+static pthread_mutex_t fast_ratio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fast_resampler
+{
+    const struct fast_ratio *ratio;
+    enum AVSampleFormat sample_fmt;
+    /* Mono input history as floats */
+    float *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    /* Input index of buf[0], negative for the leading zeros */
+    int64_t buf_start;
+    /* Input index after the last sample received */
+    int64_t in_count;
+    /* Output index of the next sample */
+    int64_t out_count;
+    /* Take the input index of the first frame from its timestamp instead of
+     * starting at 0, for input that has been seeked */
+    bool absolute;
+    bool started;
+    AVRational time_base;
+    int64_t start_time;
+    /* Filter delay in upsampled samples */
+    int64_t delay;
+    float *out;
+    size_t out_cap;
+};
+
+/* Zeroth order modified Bessel function of the first kind */
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
+    for (k = 1; k < 64; ++k)
     {
-        averror("could not allocate packet");
-        ret = 3;
-        goto error;
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
     }
-    if (!(frame = av_frame_alloc()))
+    return sum;
+}
+
+/* Compute the coefficient table once, shared by all conversions */
+static bool fast_ratio_init(struct fast_ratio *r)
+{
+    const int len = r->up * FAST_TAPS;
+    /* Cutoff in cycles per upsampled sample */
+    const double fc = FAST_CUTOFF / ((double)r->in_rate * r->up);
+    const double center = (len - 1) / 2.0;
+    const double i0_beta = bessel_i0(FAST_BETA);
+    float *coef;
+    int k;
+
+    pthread_mutex_lock(&fast_ratio_lock);
+    if (r->coef)
     {
-        averror("could not allocate frame");
-        ret = 3;
-        goto error;
+        pthread_mutex_unlock(&fast_ratio_lock);
+        return true;
     }
-    if (!(filtered_frame = av_frame_alloc()))
+    if (posix_memalign((void **)&coef, 32, sizeof(float) * len) != 0)
     {
-        averror("could not allocate filtered frame");
-        ret = 3;
-        goto error;
+        pthread_mutex_unlock(&fast_ratio_lock);
+        return false;
+    }
+    for (k = 0; k < len; ++k)
+    {
+        double t = k - center;
+        double ratio = t / (center + 0.5);
+        double sinc = t == 0 ? 1 : sin(2 * M_PI * fc * t) / (2 * M_PI * fc * t);
+        double window = bessel_i0(FAST_BETA * sqrt(1 - ratio * ratio)) / i0_beta;
+        /* The gain of up compensates for the zeros inserted by upsampling */
+        double h = r->up * 2 * fc * sinc * window;
+        /* Branch k % up, tap k / up, reversed */
+        coef[(k % r->up) * FAST_TAPS + FAST_TAPS - 1 - k / r->up] = (float)h;
     }
+    r->coef = coef;
+    pthread_mutex_unlock(&fast_ratio_lock);
+    return true;
+}
 
-    while (true)
+/* Create a resampler if the decoder output is something it handles */
+static struct fast_resampler *fast_create(const AVCodecContext *avc_ctx)
+{
+    struct fast_resampler *fr;
+    struct fast_ratio *ratio = NULL;
+    size_t i;
+
+    if (avc_ctx->channels != 2)
+        return NULL;
+    if (avc_ctx->sample_fmt != AV_SAMPLE_FMT_S16 &&
+        avc_ctx->sample_fmt != AV_SAMPLE_FMT_S16P &&
+        avc_ctx->sample_fmt != AV_SAMPLE_FMT_FLT &&
+        avc_ctx->sample_fmt != AV_SAMPLE_FMT_FLTP)
+        return NULL;
+    for (i = 0; i < sizeof(FAST_RATIOS) / sizeof(FAST_RATIOS[0]); ++i)
+        if (FAST_RATIOS[i].in_rate == avc_ctx->sample_rate)
+            ratio = &FAST_RATIOS[i];
+    if (!ratio || !fast_ratio_init(ratio))
+        return NULL;
+    if (!(fr = calloc(1, sizeof(*fr))))
+        return NULL;
+    fr->ratio = ratio;
+    fr->sample_fmt = avc_ctx->sample_fmt;
+    fr->delay = ((int64_t)ratio->up * FAST_TAPS - 1) / 2;
+    /* History for the first output sample is all zeros */
+    fr->buf_cap = 2 * FAST_TAPS;
+    if (!(fr->buf = calloc(fr->buf_cap, sizeof(float))))
     {
-        int stat = 0;
-        if (av_read_frame(fmt_ctx, packet) < 0)
-            break;
-        if (packet->stream_index == ast->index)
+        free(fr);
+        return NULL;
+    }
+    fr->buf_len = FAST_TAPS - 1;
+    fr->buf_start = -(FAST_TAPS - 1);
+    return fr;
+}
+
+static void fast_free(struct fast_resampler *fr)
+{
+    if (!fr)
+        return;
+    free(fr->buf);
+    free(fr->out);
+    free(fr);
+}
+
+/* Make room for n more history samples */
+static bool fast_reserve(struct fast_resampler *fr, size_t n)
+{
+    if (fr->buf_len + n > fr->buf_cap)
+    {
+        size_t cap = 2 * (fr->buf_len + n);
+        float *tmp = realloc(fr->buf, cap * sizeof(float));
+        if (!tmp)
+            return false;
+        fr->buf = tmp;
+        fr->buf_cap = cap;
+    }
+    return true;
+}
+
+/* Average the two channels of n samples into dst */
+static void fast_downmix(const AVFrame *frame, enum AVSampleFormat fmt,
+                         float *dst, int n)
+{
+    int i = 0;
+    switch (fmt)
+    {
+        case AV_SAMPLE_FMT_S16:
         {
-            if (avcodec_send_packet(avc_ctx, packet) < 0)
+            const int16_t *src = (const int16_t *)frame->data[0];
+#ifdef __SSE2__
+            const __m128i ones = _mm_set1_epi16(1);
+            const __m128 scale = _mm_set1_ps(0.5f / 32768);
+            for (; i + 4 <= n; i += 4)
             {
-                averror("error while sending a packet to the decoder");
-                ret = 3;
-                goto error;
+                /* l0 r0 l1 r1 ... -> l0 + r0, l1 + r1, ... */
+                __m128i lr = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+                __m128i sum = _mm_madd_epi16(lr, ones);
+                _mm_storeu_ps(dst + i,
+                              _mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
             }
-            while (true)
+#endif
+            for (; i < n; ++i)
+                dst[i] = (src[2 * i] + src[2 * i + 1]) * (0.5f / 32768);
+            break;
+        }
+        case AV_SAMPLE_FMT_S16P:
+        {
+            const int16_t *l = (const int16_t *)frame->extended_data[0];
+            const int16_t *r = (const int16_t *)frame->extended_data[1];
+            for (; i < n; ++i)
+                dst[i] = (l[i] + r[i]) * (0.5f / 32768);
+            break;
+        }
+        case AV_SAMPLE_FMT_FLT:
+        {
+            const float *src = (const float *)frame->data[0];
+#ifdef __SSE2__
+            const __m128 half = _mm_set1_ps(0.5f);
+            for (; i + 4 <= n; i += 4)
             {
-                stat = avcodec_receive_frame(avc_ctx, frame);
-                if (stat == AVERROR(EAGAIN) || stat == AVERROR_EOF)
-                    break;
-                if (stat < 0)
-                {
-                    averror("error while receiving a frame from the decoder");
-                    ret = 3;
-                    goto error;
-                }
-                /* if (stat >= 0) */
-                if (av_buffersrc_add_frame_flags(
-                        buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+                __m128 a = _mm_loadu_ps(src + 2 * i);
+                __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+                __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+                __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+                _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+            }
+#endif
+            for (; i < n; ++i)
+                dst[i] = (src[2 * i] + src[2 * i + 1]) * 0.5f;
+            break;
+        }
+        case AV_SAMPLE_FMT_FLTP:
+        {
+            const float *l = (const float *)frame->extended_data[0];
+            const float *r = (const float *)frame->extended_data[1];
+#ifdef __SSE2__
+            const __m128 half = _mm_set1_ps(0.5f);
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(dst + i,
+                              _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(l + i),
+                                                    _mm_loadu_ps(r + i)),
+                                         half));
+#endif
+            for (; i < n; ++i)
+                dst[i] = (l[i] + r[i]) * 0.5f;
+            break;
+        }
+        default:
+            abort();
+    }
+}
+
+/* Dot product of FAST_TAPS samples */
+static float fast_dot(const float *coef, const float *x)
+{
+    int i;
+#if defined(__AVX__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m128 lo;
+    for (i = 0; i < FAST_TAPS; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_load_ps(coef + i),
+                               _mm256_loadu_ps(x + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_load_ps(coef + i + 8),
+                               _mm256_loadu_ps(x + i + 8), acc1);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    lo = _mm_add_ps(_mm256_castps256_ps128(acc0),
+                    _mm256_extractf128_ps(acc0, 1));
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+#elif defined(__SSE2__)
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    for (i = 0; i < FAST_TAPS; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(coef + i),
+                                           _mm_loadu_ps(x + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(coef + i + 4),
+                                           _mm_loadu_ps(x + i + 4)));
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+    acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+    return _mm_cvtss_f32(acc0);
+#else
+    float sum = 0;
+    for (i = 0; i < FAST_TAPS; ++i)
+        sum += coef[i] * x[i];
+    return sum;
+#endif
+}
+
+/* Quantize like FFmpeg's flt -> u8: clip(round(x * 128) + 128) */
+static void fast_quantize(const float *src, uint8_t *dst, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(128.0f);
+    const __m128i offset = _mm_set1_epi32(128);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_add_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale)), offset);
+        __m128i b = _mm_add_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale)),
+            offset);
+        __m128i c = _mm_add_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 8), scale)),
+            offset);
+        __m128i d = _mm_add_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 12), scale)),
+            offset);
+        /* Saturating packs do the clipping */
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                          _mm_packs_epi32(c, d)));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        long v = lrintf(src[i] * 128.0f) + 128;
+        dst[i] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+    }
+}
+
+/* Feed one decoded frame (NULL to flush) and pass the converted samples to
+ * the next sink as a u8 frame */
+static int fast_filter_frame(struct fast_resampler *fr, AVFrame *frame,
+                             AVFrame *out_frame, frame_sink sink,
+                             void *opaque)
+{
+    const int64_t up = fr->ratio->up, down = fr->ratio->down;
+    int64_t last, count, n;
+    if (frame && fr->absolute && !fr->started && frame->pts != AV_NOPTS_VALUE)
+    {
+        /* Unknown history before the first frame is taken as zeros */
+        int64_t first = av_rescale_q(frame->pts - fr->start_time,
+                                     fr->time_base,
+                                     (AVRational){1, fr->ratio->in_rate});
+        fr->buf_start += first;
+        fr->in_count = first;
+        fr->out_count = first > 0 ? (first * up + down - 1) / down : 0;
+    }
+    fr->started = true;
+    if (frame)
+    {
+        if (frame->format != fr->sample_fmt || frame->channels != 2 ||
+            frame->sample_rate != fr->ratio->in_rate)
+        {
+            averror("input format changed midstream");
+            return 3;
+        }
+        if (!fast_reserve(fr, frame->nb_samples))
+        {
+            averror("could not allocate resampler buffer");
+            return 3;
+        }
+        fast_downmix(frame, fr->sample_fmt, fr->buf + fr->buf_len,
+                     frame->nb_samples);
+        fr->buf_len += frame->nb_samples;
+        fr->in_count += frame->nb_samples;
+        /* Every output needs its whole history */
+        last = fr->buf_start + (int64_t)fr->buf_len - 1;
+        count = (last + 1) * up - 1 - fr->delay;
+        count = count < 0 ? 0 : count / down + 1 - fr->out_count;
+    }
+    else
+    {
+        /* The input is followed by zeros, pad enough of them */
+        size_t pad = fr->delay / up + 2;
+        if (!fast_reserve(fr, pad))
+        {
+            averror("could not allocate resampler buffer");
+            return 3;
+        }
+        memset(fr->buf + fr->buf_len, 0, pad * sizeof(float));
+        fr->buf_len += pad;
+        count = (fr->in_count * up + down - 1) / down - fr->out_count;
+    }
+
+    if (count > 0)
+    {
+        if ((size_t)count > fr->out_cap)
+        {
+            free(fr->out);
+            if (!(fr->out = malloc(count * sizeof(float))))
+            {
+                fr->out_cap = 0;
+                averror("could not allocate resampler buffer");
+                return 3;
+            }
+            fr->out_cap = count;
+        }
+        for (n = 0; n < count; ++n)
+        {
+            int64_t u = (fr->out_count + n) * down + fr->delay;
+            int64_t i = u / up;
+            fr->out[n] = fast_dot(fr->ratio->coef + (u % up) * FAST_TAPS,
+                                  fr->buf + (i - FAST_TAPS + 1 - fr->buf_start));
+        }
+
+        out_frame->format = AV_SAMPLE_FMT_U8;
+        out_frame->channel_layout = AV_CH_LAYOUT_MONO;
+        out_frame->channels = 1;
+        out_frame->sample_rate = DST_SAMPLE_RATE;
+        out_frame->nb_samples = count;
+        out_frame->pts = fr->out_count;
+        if (av_frame_get_buffer(out_frame, 0) < 0)
+        {
+            averror("could not allocate output frame");
+            return 3;
+        }
+        fast_quantize(fr->out, out_frame->data[0], count);
+        fr->out_count += count;
+        n = sink(opaque, out_frame);
+        av_frame_unref(out_frame);
+        if (n != 0)
+            return n;
+
+        /* Drop history that no later output needs */
+        {
+            int64_t keep = (fr->out_count * down + fr->delay) / up -
+                           FAST_TAPS + 1 - fr->buf_start;
+            if (keep > 0 && (size_t)keep <= fr->buf_len)
+            {
+                memmove(fr->buf, fr->buf + keep,
+                        (fr->buf_len - keep) * sizeof(float));
+                fr->buf_len -= keep;
+                fr->buf_start += keep;
+            }
+        }
+    }
+    return frame ? 0 : sink(opaque, NULL);
+}
+
+/* State of the filter stage */
+struct filter_stage
+{
+    AVFilterContext *buffersrc_ctx;
+    AVFilterContext *buffersink_ctx;
+    /* Used instead of the filter graph if set */
+    struct fast_resampler *fast;
+    AVFrame *filtered_frame;
+    frame_sink sink;
+    void *opaque;
+};
+
+/* Feed one frame (NULL to flush) through the filter graph, passing every
+ * filtered frame to the next sink */
+static int filter_frame(void *opaque, AVFrame *frame)
+{
+    struct filter_stage *fs = opaque;
+    if (fs->fast)
+        return fast_filter_frame(fs->fast, frame, fs->filtered_frame, fs->sink,
+                                 fs->opaque);
+    if (av_buffersrc_add_frame_flags(fs->buffersrc_ctx, frame,
+                                     AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+    {
+        averror("error while feeding the audio filter");
+        return 3;
+    }
+    while (true)
+    {
+        int stat = av_buffersink_get_frame(fs->buffersink_ctx,
+                                           fs->filtered_frame);
+        if (stat == AVERROR(EAGAIN) || stat == AVERROR_EOF)
+            break;
+        if (stat < 0)
+        {
+            averror("error while receiving a frame from the filter");
+            return 3;
+        }
+        stat = fs->sink(fs->opaque, fs->filtered_frame);
+        av_frame_unref(fs->filtered_frame);
+        if (stat != 0)
+            return stat;
+    }
+    return frame ? 0 : fs->sink(fs->opaque, NULL);
+}
+
+/* Write one filtered frame to the output */
+static int write_frame(void *opaque, AVFrame *frame)
+{
+    struct writer *w = opaque;
+    if (!frame)
+        return 0;
+    /* Mono 8-bit, so one byte per sample */
+    if (writer_write(w, frame->data[0], frame->nb_samples) != 0)
+    {
+        averror("error while writing the output");
+        return 3;
+    }
+    return 0;
+}
+
+/* Bounded single-producer single-consumer queue of frames.
+ * The fast path is lock-free; the mutex is only taken to sleep when the
+ * queue is full or empty and to wake such a sleeper. */
+struct frame_queue
+{
+    AVFrame *slot[QUEUE_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int sleepers;
+    atomic_bool aborted;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void queue_init(struct frame_queue *q)
+{
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->sleepers, 0);
+    atomic_init(&q->aborted, false);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_destroy(struct frame_queue *q)
+{
+    size_t i;
+    for (i = atomic_load(&q->tail); i != atomic_load(&q->head); ++i)
+        av_frame_free(&q->slot[i % QUEUE_SIZE]);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static void queue_wake(struct frame_queue *q)
+{
+    /* Order the release of head or tail before the load of sleepers, pairs
+     * with the fence in queue_wait() */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&q->sleepers))
+    {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/* Make both ends give up, used when a stage fails */
+static void queue_abort(struct frame_queue *q)
+{
+    atomic_store(&q->aborted, true);
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Wait until the queue is not full (for_push) or not empty.
+ * Returns false if the queue has been aborted */
+static bool queue_wait(struct frame_queue *q, bool for_push)
+{
+    int spins;
+    for (spins = 0;; ++spins)
+    {
+        size_t used = atomic_load(&q->head) - atomic_load(&q->tail);
+        if (atomic_load(&q->aborted))
+            return false;
+        if (for_push ? used < QUEUE_SIZE : used > 0)
+            return true;
+        if (spins < 64)
+        {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&q->lock);
+        atomic_fetch_add(&q->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        used = atomic_load(&q->head) - atomic_load(&q->tail);
+        if (!atomic_load(&q->aborted) &&
+            (for_push ? used == QUEUE_SIZE : used == 0))
+            pthread_cond_wait(&q->cond, &q->lock);
+        atomic_fetch_sub(&q->sleepers, 1);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/* Take a reference of `frame` (NULL for end of stream) into the queue */
+static int queue_push(void *opaque, AVFrame *frame)
+{
+    struct frame_queue *q = opaque;
+    AVFrame *ref = NULL;
+    size_t head;
+    if (frame)
+    {
+        if (!(ref = av_frame_alloc()))
+        {
+            averror("could not allocate frame");
+            return 3;
+        }
+        av_frame_move_ref(ref, frame);
+    }
+    if (!queue_wait(q, true))
+    {
+        av_frame_free(&ref);
+        return 3;
+    }
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    q->slot[head % QUEUE_SIZE] = ref;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    queue_wake(q);
+    return 0;
+}
+
+/* Take the next frame out of the queue. Returns false if aborted */
+static bool queue_pop(struct frame_queue *q, AVFrame **pframe)
+{
+    size_t tail;
+    if (!queue_wait(q, false))
+        return false;
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    *pframe = q->slot[tail % QUEUE_SIZE];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    queue_wake(q);
+    return true;
+}
+
+/* Pipelined conversion state */
+struct pipeline
+{
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *avc_ctx;
+    AVStream *ast;
+    struct filter_stage *fs;
+    struct frame_queue decoded;
+    struct frame_queue filtered;
+    int decode_ret;
+    int filter_ret;
+};
+
+static void *decode_main(void *arg)
+{
+    struct pipeline *pl = arg;
+    pl->decode_ret = decode_stream(pl->fmt_ctx, pl->avc_ctx, pl->ast,
+                                   queue_push, &pl->decoded);
+    if (pl->decode_ret != 0)
+    {
+        queue_abort(&pl->decoded);
+        queue_abort(&pl->filtered);
+    }
+    return NULL;
+}
+
+static void *filter_main(void *arg)
+{
+    struct pipeline *pl = arg;
+    AVFrame *frame = NULL;
+    pl->filter_ret = 3;
+    while (queue_pop(&pl->decoded, &frame))
+    {
+        pl->filter_ret = filter_frame(pl->fs, frame);
+        if (!frame || pl->filter_ret != 0)
+            break;
+        av_frame_free(&frame);
+    }
+    av_frame_free(&frame);
+    if (pl->filter_ret != 0)
+    {
+        queue_abort(&pl->decoded);
+        queue_abort(&pl->filtered);
+    }
+    return NULL;
+}
+
+/* Run decoding, filtering and writing in three threads */
+static int run_pipeline(AVFormatContext *fmt_ctx, AVCodecContext *avc_ctx,
+                        AVStream *ast, struct filter_stage *fs,
+                        struct writer *w)
+{
+    struct pipeline pl;
+    pthread_t decoder, filter;
+    AVFrame *frame;
+    int ret = 3;
+
+    pl.fmt_ctx = fmt_ctx;
+    pl.avc_ctx = avc_ctx;
+    pl.ast = ast;
+    pl.fs = fs;
+    pl.decode_ret = pl.filter_ret = 0;
+    queue_init(&pl.decoded);
+    queue_init(&pl.filtered);
+    fs->sink = queue_push;
+    fs->opaque = &pl.filtered;
+    if (pthread_create(&decoder, NULL, decode_main, &pl) != 0)
+    {
+        averror("could not create decoder thread");
+        goto out;
+    }
+    if (pthread_create(&filter, NULL, filter_main, &pl) != 0)
+    {
+        averror("could not create filter thread");
+        queue_abort(&pl.decoded);
+        pthread_join(decoder, NULL);
+        goto out;
+    }
+    while (queue_pop(&pl.filtered, &frame))
+    {
+        if (!frame)
+        {
+            ret = 0;
+            break;
+        }
+        ret = write_frame(w, frame);
+        av_frame_free(&frame);
+        if (ret != 0)
+        {
+            queue_abort(&pl.filtered);
+            queue_abort(&pl.decoded);
+            break;
+        }
+    }
+    pthread_join(filter, NULL);
+    pthread_join(decoder, NULL);
+    if (ret == 0)
+        ret = pl.decode_ret ? pl.decode_ret : pl.filter_ret;
+
+out:
+    queue_destroy(&pl.filtered);
+    queue_destroy(&pl.decoded);
+    return ret;
+}
+
+/* Convert one input, return values as those of main() */
+static int convert(const char *input_url, int output,
+                   struct decoder_cache *cache)
+{
+    AVStream *ast = NULL;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *avc_ctx = NULL;
+    AVFilterGraph *filter_graph = NULL;
+    struct filter_stage fs = {NULL};
+    struct writer writer;
+    bool writer_opened = false;
+    int ret = 0;
+
+    if ((ret = open_audio_stream(input_url, cache, &fmt_ctx, &avc_ctx,
+                                 &ast)) != 0)
+        return ret;
+
+    if (app_data.fast && (fs.fast = fast_create(avc_ctx)))
+        v_printf("Using the built-in converter\n");
+    else
+    {
+        if (app_data.fast)
+            v_printf("Input not supported by the built-in converter, "
+                     "using the filter graph\n");
+        if ((ret = create_filters(ast, avc_ctx, AV_NOPTS_VALUE, &filter_graph,
+                                  &fs.buffersrc_ctx, &fs.buffersink_ctx)) != 0)
+            goto error;
+    }
+
+    if ((errno = writer_open(&writer, output, app_data.writer_thread)) != 0)
+    {
+        averror("could not set up the output");
+        ret = 3;
+        goto error;
+    }
+    writer_opened = true;
+
+    if (!(fs.filtered_frame = av_frame_alloc()))
+    {
+        averror("could not allocate filtered frame");
+        ret = 3;
+        goto error;
+    }
+
+    if (app_data.pipeline)
+        ret = run_pipeline(fmt_ctx, avc_ctx, ast, &fs, &writer);
+    else
+    {
+        fs.sink = write_frame;
+        fs.opaque = &writer;
+        ret = decode_stream(fmt_ctx, avc_ctx, ast, filter_frame, &fs);
+    }
+
+error:
+    if (writer_opened && writer_close(&writer) != 0 && ret == 0)
+    {
+        averror("error while writing the output");
+        ret = 3;
+    }
+    av_frame_free(&fs.filtered_frame);
+    fast_free(fs.fast);
+    avfilter_graph_free(&filter_graph);
+    /* A decoder that failed is not trusted with the next input */
+    release_decoder(ret == 0 ? cache : NULL, &avc_ctx, ast);
+    close_input(&fmt_ctx);
+    return ret;
+}
+
+/* One line of the batch manifest */
+struct batch_job
+{
+    char *input;
+    char *output;
+    int ret;
+};
+
+struct batch
+{
+    struct batch_job *jobs;
+    size_t count;
+    atomic_size_t next;
+};
+
+/* Read "INPUT<TAB>OUTPUT" lines. Empty lines and lines starting with '#'
+ * are ignored */
+static int read_manifest(const char *path, struct batch *batch)
+{
+    FILE *manifest = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t line_size = 0, allocated = 0, lineno = 0;
+    ssize_t len;
+    int ret = 0;
+
+    if (!manifest)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    while ((len = getline(&line, &line_size, manifest)) >= 0)
+    {
+        char *tab;
+        ++lineno;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        if (!(tab = strchr(line, '\t')))
+        {
+            fprintf(stderr, "%s:%zu: expecting INPUT<TAB>OUTPUT\n", path,
+                    lineno);
+            ret = 2;
+            break;
+        }
+        *tab = '\0';
+        if (batch->count == allocated)
+        {
+            struct batch_job *tmp;
+            allocated = allocated ? 2 * allocated : 64;
+            tmp = realloc(batch->jobs, allocated * sizeof(*tmp));
+            if (!tmp)
+            {
+                fprintf(stderr, "could not allocate the job list\n");
+                ret = 3;
+                break;
+            }
+            batch->jobs = tmp;
+        }
+        batch->jobs[batch->count].input = strdup(line);
+        batch->jobs[batch->count].output = strdup(tab + 1);
+        batch->jobs[batch->count].ret = 0;
+        ++batch->count;
+    }
+    free(line);
+    if (manifest != stdin)
+        fclose(manifest);
+    return ret;
+}
+
+/* Worker thread: take jobs until there is none left */
+static void *batch_worker(void *arg)
+{
+    struct batch *batch = arg;
+    /* The workers already keep the CPUs busy */
+    struct decoder_cache cache = {NULL, NULL, 1};
+    size_t idx;
+    while ((idx = atomic_fetch_add(&batch->next, 1)) < batch->count)
+    {
+        struct batch_job *job = &batch->jobs[idx];
+        int output = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output < 0)
+        {
+            fprintf(stderr, "%s: %s\n", job->output, strerror(errno));
+            job->ret = 2;
+            continue;
+        }
+        job->ret = convert(job->input, output, &cache);
+        if (close(output) != 0 && job->ret == 0)
+            job->ret = 3;
+        if (job->ret != 0)
+            fprintf(stderr, "%s: conversion failed with status %d\n",
+                    job->input, job->ret);
+        else
+            v_printf("%s: done\n", job->input);
+    }
+    free_decoder_cache(&cache);
+    return NULL;
+}
+
+/* Convert everything in the manifest. Returns the worst status */
+static int run_batch(void)
+{
+    struct batch batch;
+    pthread_t *workers;
+    long nworkers = app_data.jobs, started, i;
+    size_t failed = 0, j;
+    int ret;
+
+    batch.jobs = NULL;
+    batch.count = 0;
+    if ((ret = read_manifest(app_data.manifest, &batch)) != 0)
+        goto out;
+    atomic_init(&batch.next, 0);
+    if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nworkers = 1;
+    if ((size_t)nworkers > batch.count)
+        nworkers = batch.count ? batch.count : 1;
+    if (!(workers = malloc(nworkers * sizeof(*workers))))
+    {
+        fprintf(stderr, "could not allocate workers\n");
+        ret = 3;
+        goto out;
+    }
+    for (started = 0; started < nworkers; ++started)
+        if (pthread_create(&workers[started], NULL, batch_worker, &batch) !=
+            0)
+            break;
+    if (started == 0)
+    {
+        /* Do it ourselves then */
+        batch_worker(&batch);
+    }
+    for (i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    for (j = 0; j < batch.count; ++j)
+    {
+        if (batch.jobs[j].ret != 0)
+            ++failed;
+        if (batch.jobs[j].ret > ret)
+            ret = batch.jobs[j].ret;
+    }
+    if (failed || app_data.if_verbose)
+        fprintf(stderr, "%zu of %zu conversions failed\n", failed,
+                batch.count);
+
+out:
+    for (j = 0; j < batch.count; ++j)
+    {
+        free(batch.jobs[j].input);
+        free(batch.jobs[j].output);
+    }
+    free(batch.jobs);
+    return ret;
+}
+
+/* Returned by a slice that could not start where it had to */
+#define SEGMENT_MISALIGNED (-2)
+
+/* Output of one time slice: samples [from, to) go to their offsets in fd */
+struct segment_sink
+{
+    int fd;
+    int64_t from;
+    int64_t to;
+    /* The first sample must be this one, so that the resampler runs in the
+     * phase of a single pass; -1 if any sample up to from will do */
+    int64_t start;
+    bool started;
+    /* Time base of the frame pts and the pts of output sample 0 in it */
+    AVRational time_base;
+    int64_t origin;
+    /* One past the last sample written */
+    int64_t end;
+};
+
+static int write_segment(void *opaque, AVFrame *frame)
+{
+    struct segment_sink *seg = opaque;
+    int64_t first, lo, hi;
+    if (!frame)
+        return 0;
+    if (frame->pts == AV_NOPTS_VALUE)
+    {
+        averror("filtered frame has no timestamp");
+        return 3;
+    }
+    first = av_rescale_q(frame->pts - seg->origin, seg->time_base,
+                         (AVRational){1, DST_SAMPLE_RATE});
+    if (!seg->started)
+    {
+        /* A seek past the start would leave a gap or shift the phase */
+        seg->started = true;
+        if (seg->start >= 0 ? first != seg->start : first > seg->from)
+            return SEGMENT_MISALIGNED;
+    }
+    if (first >= seg->to)
+        return SINK_STOP;
+    lo = first > seg->from ? first : seg->from;
+    hi = first + frame->nb_samples < seg->to ? first + frame->nb_samples
+                                             : seg->to;
+    while (lo < hi)
+    {
+        ssize_t written =
+            pwrite(seg->fd, frame->data[0] + (lo - first), hi - lo, lo);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            averror("error while writing the output");
+            return 3;
+        }
+        lo += written;
+    }
+    if (hi > seg->end)
+        seg->end = hi;
+    return 0;
+}
+
+/* One time slice of a segmented conversion */
+struct segment
+{
+    const char *input_url;
+    struct segment_sink sink;
+    /* Where to start decoding, in AV_TIME_BASE */
+    int64_t seek_to;
+    /* Input samples from the stream start dropped before resampling, or
+     * AV_NOPTS_VALUE */
+    int64_t trim;
+    int ret;
+};
+
+static void *segment_main(void *arg)
+{
+    struct segment *seg = arg;
+    struct decoder_cache cache = {NULL, NULL, 1};
+    AVStream *ast = NULL;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *avc_ctx = NULL;
+    AVFilterGraph *filter_graph = NULL;
+    struct filter_stage fs = {NULL};
+    int64_t start_time;
+
+    if ((seg->ret = open_audio_stream(seg->input_url, &cache, &fmt_ctx,
+                                      &avc_ctx, &ast)) != 0)
+        return NULL;
+    start_time = ast->start_time == AV_NOPTS_VALUE ? 0 : ast->start_time;
+    if (seg->seek_to > 0)
+    {
+        int64_t ts = start_time + av_rescale_q(seg->seek_to, AV_TIME_BASE_Q,
+                                               ast->time_base);
+        if (avformat_seek_file(fmt_ctx, ast->index, INT64_MIN, ts, ts, 0) < 0)
+        {
+            averror("could not seek the input");
+            seg->ret = 2;
+            goto out;
+        }
+    }
+
+    if (app_data.fast && (fs.fast = fast_create(avc_ctx)))
+    {
+        /* Its timestamps count output samples from the stream start */
+        fs.fast->absolute = true;
+        fs.fast->time_base = ast->time_base;
+        fs.fast->start_time = start_time;
+        seg->sink.time_base = (AVRational){1, DST_SAMPLE_RATE};
+        seg->sink.origin = 0;
+        seg->sink.start = -1;
+    }
+    else
+    {
+        int64_t trim = seg->trim;
+        if (trim != AV_NOPTS_VALUE)
+            trim += av_rescale_q(start_time, ast->time_base,
+                                 (AVRational){1, avc_ctx->sample_rate});
+        if ((seg->ret = create_filters(ast, avc_ctx, trim, &filter_graph,
+                                       &fs.buffersrc_ctx,
+                                       &fs.buffersink_ctx)) != 0)
+            goto out;
+        seg->sink.time_base = av_buffersink_get_time_base(fs.buffersink_ctx);
+        seg->sink.origin =
+            av_rescale_q(start_time, ast->time_base, seg->sink.time_base);
+    }
+    if (!(fs.filtered_frame = av_frame_alloc()))
+    {
+        averror("could not allocate filtered frame");
+        seg->ret = 3;
+        goto out;
+    }
+    fs.sink = write_segment;
+    fs.opaque = &seg->sink;
+    seg->ret = decode_stream(fmt_ctx, avc_ctx, ast, filter_frame, &fs);
+
+out:
+    av_frame_free(&fs.filtered_frame);
+    fast_free(fs.fast);
+    avfilter_graph_free(&filter_graph);
+    avcodec_free_context(&avc_ctx);
+    close_input(&fmt_ctx);
+    free_decoder_cache(&cache);
+    return NULL;
+}
+
+/* Convert a long input as app_data.segments time slices decoded in
+ * parallel. Each slice starts decoding SEGMENT_MARGIN seconds early so that
+ * the decoder and resampler have settled when its first sample is due, and
+ * writes its samples by offset into the output file. Slices begin and feed
+ * the resampler from points where the input and output sample phases line
+ * up, as they do in a single pass; one that cannot makes the whole input
+ * be converted in a single pass instead */
+static int convert_segmented(const char *input_url, int output)
+{
+    struct stat st;
+    AVStream *ast = NULL;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *avc_ctx = NULL;
+    struct segment *segs;
+    pthread_t *threads;
+    int64_t duration, total, end = 0, period_in, period_out;
+    long k, nsegs = app_data.segments, started;
+    int ret = 0, rate;
+    bool misaligned = false;
+
+    if (fstat(output, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        v_printf("Output is not a regular file, not using segments\n");
+        return convert(input_url, output, NULL);
+    }
+    /* Probe the duration */
+    if ((ret = open_audio_stream(input_url, NULL, &fmt_ctx, &avc_ctx, &ast)) !=
+        0)
+        return ret;
+    duration = fmt_ctx->duration;
+    if (duration == AV_NOPTS_VALUE && ast->duration != AV_NOPTS_VALUE)
+        duration = av_rescale_q(ast->duration, ast->time_base, AV_TIME_BASE_Q);
+    rate = avc_ctx->sample_rate;
+    avcodec_free_context(&avc_ctx);
+    close_input(&fmt_ctx);
+    if (duration == AV_NOPTS_VALUE ||
+        duration < (int64_t)nsegs * SEGMENT_MARGIN * AV_TIME_BASE)
+    {
+        v_printf("Input too short or duration unknown, not using segments\n");
+        return convert(input_url, output, NULL);
+    }
+    total = av_rescale(duration, DST_SAMPLE_RATE, AV_TIME_BASE);
+    if (ftruncate(output, total) != 0)
+    {
+        averror("could not allocate the output file");
+        return 3;
+    }
+
+    segs = calloc(nsegs, sizeof(*segs));
+    threads = calloc(nsegs, sizeof(*threads));
+    if (!segs || !threads)
+    {
+        averror("could not allocate segments");
+        free(segs);
+        free(threads);
+        return 3;
+    }
+    /* The phases line up every period_out output samples, e.g. every 80
+     * (10 ms) for 44100 Hz input */
+    period_out = DST_SAMPLE_RATE / av_gcd(rate, DST_SAMPLE_RATE);
+    period_in = rate / av_gcd(rate, DST_SAMPLE_RATE);
+    for (k = 0; k < nsegs; ++k)
+    {
+        segs[k].input_url = input_url;
+        segs[k].sink.fd = output;
+        segs[k].sink.from = total * k / nsegs / period_out * period_out;
+        /* The duration is only an estimate, the last one takes the rest */
+        segs[k].sink.to = k == nsegs - 1 ? INT64_MAX
+                                         : total * (k + 1) / nsegs /
+                                               period_out * period_out;
+        segs[k].sink.start = -1;
+        segs[k].seek_to = 0;
+        segs[k].trim = AV_NOPTS_VALUE;
+        if (k > 0)
+        {
+            int64_t start =
+                segs[k].sink.from - SEGMENT_MARGIN * DST_SAMPLE_RATE;
+            start = start > 0 ? start / period_out * period_out : 0;
+            segs[k].sink.start = start;
+            segs[k].trim = start / period_out * period_in;
+            segs[k].seek_to = av_rescale(start, AV_TIME_BASE, DST_SAMPLE_RATE);
+        }
+    }
+    for (started = 0; started < nsegs; ++started)
+        if (pthread_create(&threads[started], NULL, segment_main,
+                           &segs[started]) != 0)
+            break;
+    for (k = 0; k < started; ++k)
+        pthread_join(threads[k], NULL);
+    /* Run whatever could not get a thread here */
+    for (k = started; k < nsegs; ++k)
+        segment_main(&segs[k]);
+
+    for (k = 0; k < nsegs; ++k)
+    {
+        if (segs[k].ret == SEGMENT_MISALIGNED)
+            misaligned = true;
+        else if (segs[k].ret > ret)
+            ret = segs[k].ret;
+        if (segs[k].sink.end > end)
+            end = segs[k].sink.end;
+    }
+    free(segs);
+    free(threads);
+    if (misaligned && ret == 0)
+    {
+        v_printf("A slice could not start in phase, using a single pass\n");
+        if (ftruncate(output, 0) != 0 || lseek(output, 0, SEEK_SET) != 0)
+        {
+            averror("could not truncate the output file");
+            return 3;
+        }
+        return convert(input_url, output, NULL);
+    }
+    /* Cut off what the estimated duration overshot */
+    if (ret == 0 && ftruncate(output, end) != 0)
+    {
+        averror("could not truncate the output file");
+        ret = 3;
+    }
+    return ret;
+}
+
+/* Daemon mode.
+ * Clients connect to a SOCK_SEQPACKET UNIX socket and send one message per
+ * job: a payload of "-" and the input and output file descriptors as
+ * SCM_RIGHTS. The daemon never opens a path or URL itself, so a client can
+ * only have it read what the client could open. The socket is only
+ * accessible to the user running the daemon. The reply is the status of the
+ * conversion as a decimal number, with the same meaning as the exit status.
+ * Jobs of one connection run one at a time and in order; parallel jobs need
+ * more connections. */
+
+/* Longest payload in a request */
+#define REQUEST_SIZE 16
+
+struct daemon_job
+{
+    /* Connection to reply on */
+    int conn;
+    int input;
+    int output;
+    struct daemon_job *next;
+};
+
+struct daemon
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct daemon_job *head;
+    struct daemon_job **tail;
+    bool stopping;
+    /* Workers hand connections whose job is done back through this pipe */
+    int done[2];
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+static void daemon_reply(int conn, int status)
+{
+    char reply[16];
+    int len = snprintf(reply, sizeof(reply), "%d", status);
+    /* The client may be gone already, nothing to do about it */
+    if (send(conn, reply, len, MSG_NOSIGNAL) < 0)
+        v_printf("could not send the reply: %s\n", strerror(errno));
+}
+
+/* Worker thread: run jobs until the daemon stops */
+static void *daemon_worker(void *arg)
+{
+    struct daemon *d = arg;
+    /* Kept warm across jobs */
+    struct decoder_cache cache = {NULL, NULL, 1};
+    while (true)
+    {
+        struct daemon_job *job;
+        char fd_url[64];
+#ifdef __linux__
+        struct stat st;
+#endif
+        bool seekable = true;
+        int ret;
+
+        pthread_mutex_lock(&d->lock);
+        while (!d->head && !d->stopping)
+            pthread_cond_wait(&d->cond, &d->lock);
+        if ((job = d->head) && !(d->head = job->next))
+            d->tail = &d->head;
+        pthread_mutex_unlock(&d->lock);
+        if (!job)
+            break;
+
+#ifdef __linux__
+        /* Regular files stay seekable when reopened by path */
+        if (fstat(job->input, &st) == 0 && S_ISREG(st.st_mode))
+            snprintf(fd_url, sizeof(fd_url), "/proc/self/fd/%d", job->input);
+        else
+#endif
+        {
+            snprintf(fd_url, sizeof(fd_url), "pipe:%d", job->input);
+            seekable = false;
+        }
+        if (app_data.segments > 1 && seekable)
+            ret = convert_segmented(fd_url, job->output);
+        else
+            ret = convert(fd_url, job->output, &cache);
+        if (close(job->output) != 0 && ret == 0)
+            ret = 3;
+        close(job->input);
+        if (ret != 0)
+            fprintf(stderr, "%s: conversion failed with status %d\n",
+                    fd_url, ret);
+        else
+            v_printf("%s: done\n", fd_url);
+        daemon_reply(job->conn, ret);
+        /* A single int is written atomically to a pipe */
+        if (write(d->done[1], &job->conn, sizeof(job->conn)) < 0)
+            averror("could not hand back a connection");
+        free(job);
+    }
+    free_decoder_cache(&cache);
+    return NULL;
+}
+
+/* Read one request from conn. Returns -1 if the connection should be
+ * closed, 0 if the request was answered right away and 1 if it was
+ * queued */
+static int daemon_request(struct daemon *d, int conn)
+{
+    char payload[REQUEST_SIZE + 1];
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {payload, REQUEST_SIZE};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct daemon_job *job;
+    int fds[2], nfds = 0, k;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if ((len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    /* Requests are never empty, so this is the end of the connection */
+    if (len == 0)
+        return -1;
+    payload[len] = '\0';
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        int n;
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > 2 - nfds)
+            n = 2 - nfds;
+        memcpy(fds + nfds, CMSG_DATA(cmsg), n * sizeof(int));
+        nfds += n;
+    }
+    /* Only descriptors, the client opens the input with its own rights */
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        strcmp(payload, "-") != 0 || nfds != 2)
+    {
+        v_printf("malformed request\n");
+        for (k = 0; k < nfds; ++k)
+            close(fds[k]);
+        daemon_reply(conn, 1);
+        return 0;
+    }
+    if (!(job = malloc(sizeof(*job))))
+    {
+        averror("could not allocate a job");
+        for (k = 0; k < nfds; ++k)
+            close(fds[k]);
+        daemon_reply(conn, 3);
+        return 0;
+    }
+    job->conn = conn;
+    job->input = fds[0];
+    job->output = fds[1];
+    job->next = NULL;
+    pthread_mutex_lock(&d->lock);
+    *d->tail = job;
+    d->tail = &job->next;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+/* Serve conversion jobs on app_data.socket_path until SIGINT or SIGTERM */
+static int run_daemon(void)
+{
+    struct daemon d;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    sigset_t block, orig_mask;
+    struct pollfd *pfds = NULL;
+    struct stat st;
+    pthread_t *workers = NULL;
+    size_t npfds = 2, allocated = 16, k;
+    long nworkers = app_data.jobs, started = 0, i;
+    int listener, ret = 0;
+    mode_t mask;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(app_data.socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", app_data.socket_path);
+        return 2;
+    }
+    strcpy(addr.sun_path, app_data.socket_path);
+    /* Replace the socket of a previous run */
+    if (lstat(app_data.socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(app_data.socket_path);
+    /* Created for the owner only, whoever connects has the daemon convert
+     * with its permissions */
+    mask = umask(S_IRWXG | S_IRWXO);
+    if ((listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", app_data.socket_path, strerror(errno));
+        umask(mask);
+        if (listener >= 0)
+            close(listener);
+        return 2;
+    }
+    umask(mask);
+
+    /* Only this thread takes the signals, and only inside ppoll() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &orig_mask);
+
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    d.head = NULL;
+    d.tail = &d.head;
+    d.stopping = false;
+    if (pipe2(d.done, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        averror("could not create a pipe");
+        d.done[0] = d.done[1] = -1;
+        ret = 3;
+        goto out;
+    }
+    if (!(pfds = malloc(allocated * sizeof(*pfds))))
+    {
+        averror("could not allocate the connection table");
+        ret = 3;
+        goto out;
+    }
+    pfds[0].fd = listener;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = d.done[0];
+    pfds[1].events = POLLIN;
+
+    /* Do the one-time setup now instead of in the first job */
+    if (app_data.fast)
+        for (k = 0; k < sizeof(FAST_RATIOS) / sizeof(FAST_RATIOS[0]); ++k)
+            fast_ratio_init(&FAST_RATIOS[k]);
+    if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nworkers = 1;
+    if (!(workers = malloc(nworkers * sizeof(*workers))))
+    {
+        averror("could not allocate workers");
+        ret = 3;
+        goto out;
+    }
+    for (started = 0; started < nworkers; ++started)
+        if (pthread_create(&workers[started], NULL, daemon_worker, &d) != 0)
+            break;
+    if (started == 0)
+    {
+        averror("could not create worker threads");
+        ret = 3;
+        goto out;
+    }
+    v_printf("Listening on %s with %ld workers\n", app_data.socket_path,
+             started);
+
+    while (!daemon_stop)
+    {
+        int conn;
+        if (ppoll(pfds, npfds, NULL, &orig_mask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            averror("error while waiting for requests");
+            ret = 3;
+            break;
+        }
+        if (pfds[0].revents & POLLIN)
+        {
+            if ((conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0)
+                v_printf("accept: %s\n", strerror(errno));
+            else if (npfds == allocated)
+            {
+                struct pollfd *tmp =
+                    realloc(pfds, 2 * allocated * sizeof(*pfds));
+                if (!tmp)
                 {
-                    averror("error while feeding the audio filter");
-                    break;
+                    averror("could not grow the connection table");
+                    close(conn);
+                    conn = -1;
                 }
-                while (true)
+                else
                 {
-                    stat =
-                        av_buffersink_get_frame(buffersink_ctx, filtered_frame);
-                    if (stat == AVERROR(EAGAIN) || stat == AVERROR_EOF)
-                        break;
-                    if (stat < 0)
-                    {
-                        averror(
-                            "error while receiving a frame from the filter");
-                        ret = 3;
-                        goto error;
-                    }
-                    {
-                        /* Assuming mono 8-bit */
-                        const int n = filtered_frame->nb_samples;
-                        const uint8_t *p = filtered_frame->data[0];
-                        const uint8_t *p_end = p + n;
-                        while (p < p_end)
-                            fputc(*p++, app_data.output);
-                    }
-                    av_frame_unref(filtered_frame);
+                    pfds = tmp;
+                    allocated *= 2;
                 }
-                av_frame_unref(frame);
-                if (stat < 0)
+            }
+            if (conn >= 0)
+            {
+                pfds[npfds].fd = conn;
+                pfds[npfds].events = POLLIN;
+                pfds[npfds].revents = 0;
+                ++npfds;
+            }
+        }
+        if (pfds[1].revents & POLLIN)
+            /* Listen to the connections with a finished job again */
+            while (read(d.done[0], &conn, sizeof(conn)) == sizeof(conn))
+                for (k = 2; k < npfds; ++k)
+                    if (pfds[k].fd == ~conn)
+                        pfds[k].fd = conn;
+        for (k = 2; k < npfds; ++k)
+        {
+            if (pfds[k].fd < 0 || !pfds[k].revents)
+                continue;
+            switch (daemon_request(&d, pfds[k].fd))
+            {
+                case -1:
+                    close(pfds[k].fd);
+                    pfds[k--] = pfds[--npfds];
+                    break;
+                case 1:
+                    /* Negative descriptors are skipped by poll() */
+                    pfds[k].fd = ~pfds[k].fd;
                     break;
             }
         }
-        av_packet_unref(packet);
     }
+    v_printf("Stopping\n");
 
-error:
-    av_frame_free(&filtered_frame);
-    av_frame_free(&frame);
-    av_packet_free(&packet);
-    avfilter_graph_free(&filter_graph);
-    avcodec_free_context(&avc_ctx);
-    avformat_close_input(&fmt_ctx);
-    fclose(app_data.output);
+out:
+    /* Let the workers finish what has been queued */
+    pthread_mutex_lock(&d.lock);
+    d.stopping = true;
+    pthread_cond_broadcast(&d.cond);
+    pthread_mutex_unlock(&d.lock);
+    for (i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    for (k = 2; pfds && k < npfds; ++k)
+        close(pfds[k].fd < 0 ? ~pfds[k].fd : pfds[k].fd);
+    free(pfds);
+    if (d.done[0] >= 0)
+    {
+        close(d.done[0]);
+        close(d.done[1]);
+    }
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.lock);
+    close(listener);
+    unlink(app_data.socket_path);
+    return ret;
+}
+
+/* Send one job to a daemon and wait for its status */
+static int submit(const char *socket_path, const char *input_url, int output)
+{
+    char reply[16];
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct sockaddr_un addr;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2], nfds = 0, sock, input = -1, ret = 3;
+    ssize_t len;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return 2;
+    }
+    strcpy(addr.sun_path, socket_path);
+    /* The input is passed open, so relative paths and permissions are those
+     * of the client */
+    if (strcmp(input_url, "-") == 0)
+        input = STDIN_FILENO;
+    else if ((input = open(input_url, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", input_url, strerror(errno));
+        return 2;
+    }
+    fds[nfds++] = input;
+    fds[nfds++] = output;
+
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", socket_path, strerror(errno));
+        ret = 2;
+        goto out;
+    }
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)"-";
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", socket_path, strerror(errno));
+        goto out;
+    }
+    while ((len = recv(sock, reply, sizeof(reply) - 1, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    if (len <= 0)
+    {
+        fprintf(stderr, "%s: no reply from the daemon\n", socket_path);
+        goto out;
+    }
+    reply[len] = '\0';
+    ret = atoi(reply);
+
+out:
+    if (sock >= 0)
+        close(sock);
+    if (input > STDIN_FILENO)
+        close(input);
+    return ret;
+}
+
+/* Return values:
+ * - 0: success
+ * - 1: argument error
+ * - 2: user-supplied parameters are bad
+ * - 3: other internal error
+ */
+int main(int argc, char **argv)
+{
+    int ret;
+
+    /* Initialization steps: parse arguments and init FFmpeg */
+    parse_args(argc, argv);
+    /* The daemon only takes what the client can open, other URLs are
+     * converted here */
+    if (app_data.socket_path && !app_data.daemon &&
+        (strcmp(app_data.input_url, "-") == 0 ||
+         access(app_data.input_url, F_OK) == 0))
+    {
+        /* The daemon does everything else */
+        ret = submit(app_data.socket_path, app_data.input_url,
+                     app_data.output);
+        close(app_data.output);
+        return ret;
+    }
+    if (app_data.if_verbose)
+        av_log_set_level(AV_LOG_VERBOSE);
+    avformat_network_init();
+
+    if (app_data.manifest)
+        return run_batch();
+    if (app_data.daemon)
+        return run_daemon();
+
+    if (app_data.segments > 1)
+        ret = convert_segmented(app_data.input_url, app_data.output);
+    else
+        ret = convert(app_data.input_url, app_data.output, NULL);
+    close(app_data.output);
     return ret;
 }
@@ -1,5 +1,5 @@
 /* Automatically publish public IP to a git README.md */
-/* dependencies: getpid(), myzhang1029/slib, libcurl and libgit2 */
+/* dependencies: getpid(), pthreads, myzhang1029/slib, libcurl and libgit2 */
 /*
  *  autoip.c
  *  Copyright (C) 2017, 2018 Zhang Maiyun <me@maiyun.me>
@@ -18,14 +18,29 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <memory.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#endif
 
 #include <curl/curl.h>
 #include <git2.h>
@@ -38,11 +53,25 @@
 #define SSHPRI "/Users/zmy/.ssh/id_rsa"
 #define SSHUSR "git"
 #define SSHPAS ""
+/* Quiet time after an address change before checking, in ms */
+#define DEBOUNCE_MS 250
+/* Longest wait for a burst of address changes to end, in ms */
+#define SETTLE_MS 800
+/* Least time between pushes, flaps within it go out as one, in ms */
+#define PUSH_DELAY_MS 15000
+/* Messages the logger holds before dropping, a power of two */
+#define LOG_SLOTS 1024
+/* Longest message, longer ones are cut */
+#define LOG_LINE 256
 #define UAGENT                                                                 \
     "Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:58.0) Gecko/20100101 "         \
     "Firefox/58.0"
 
 jmp_buf exit_point;
+/* The signal that asked to exit, main() stops at its next wait. The
+ * handler also writes to the pipe so that a wait in progress ends */
+static volatile sig_atomic_t quit_signal;
+static int quit_pipe[2] = {-1, -1};
 
 struct MemoryStruct
 {
@@ -71,44 +100,294 @@ size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb,
     return realsize;
 }
 
-static char *getctime()
+void rlae(int sig)
 {
-    time_t t;
-    char *str;
-    time(&t);
-    str = strdup(ctime(&t));
-    str[strlen(str) - 1] = 0;
-    return str;
+    int saved = errno;
+    quit_signal = sig;
+    if (quit_pipe[1] >= 0)
+    {
+        /* A full pipe wakes the wait as well, so failing is fine */
+        ssize_t unused = write(quit_pipe[1], "", 1);
+        (void)unused;
+    }
+    errno = saved;
 }
 
-void rlae(int sig)
+/* Asynchronous logger.
+ * aiinfo() and aierror() format the message straight into a slot of a
+ * bounded lock-free ring and return; a flusher thread writes the slots out,
+ * so the publish path never waits for the disk. When the ring is full,
+ * messages are dropped and counted instead. The flusher only takes a lock
+ * to sleep when the ring is empty and to be woken. */
+struct log_slot
 {
-    printf("catch signal %d, exiting\n", sig);
-    longjmp(exit_point, 2);
+    /* Index of the message this slot holds plus one once it is written,
+     * or of the next message it can take */
+    atomic_size_t seq;
+    FILE *dest;
+    time_t time;
+    int error;
+    char text[LOG_LINE];
+};
+
+static struct
+{
+    struct log_slot slots[LOG_SLOTS];
+    atomic_size_t head;
+    /* Only touched by the flusher */
+    size_t tail;
+    atomic_size_t dropped;
+    atomic_int sleepers;
+    atomic_bool stopping;
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Write JSON lines instead of text */
+    bool json;
+    /* Rotation of the log file, 0 for none */
+    FILE *file;
+    const char *path;
+    long max_size;
+    long size;
+    /* Timestamp of the last second seen, formatted */
+    time_t stamp_time;
+    char stamp[32];
+} logger;
+
+/* Format t, reusing the string while the second stays the same */
+static const char *log_stamp(time_t t)
+{
+    if (t != logger.stamp_time || !logger.stamp[0])
+    {
+        struct tm tm;
+        if (logger.json)
+            strftime(logger.stamp, sizeof(logger.stamp), "%Y-%m-%dT%H:%M:%SZ",
+                     gmtime_r(&t, &tm));
+        else
+            /* As ctime() does, without the newline */
+            strftime(logger.stamp, sizeof(logger.stamp), "%a %b %e %H:%M:%S %Y",
+                     localtime_r(&t, &tm));
+        logger.stamp_time = t;
+    }
+    return logger.stamp;
+}
+
+/* Write one message out, returns the number of bytes */
+static int log_write(FILE *dest, time_t t, int error, const char *text)
+{
+    const char *level = error ? "error" : "info";
+    int len;
+    if (!logger.json)
+        return fprintf(dest, "(%s)[%s] %s\n", level, log_stamp(t), text);
+    len = fprintf(dest, "{\"time\":\"%s\",\"level\":\"%s\",\"msg\":\"",
+                  log_stamp(t), level);
+    for (; *text; ++text)
+    {
+        unsigned char ch = *text;
+        if (ch == '"' || ch == '\\')
+            len += fprintf(dest, "\\%c", ch);
+        else if (ch < 0x20)
+            len += fprintf(dest, "\\u%04x", ch);
+        else
+        {
+            putc(ch, dest);
+            ++len;
+        }
+    }
+    return len + fprintf(dest, "\"}\n");
+}
+
+/* Start a new log file once the current one is full, keeping one old file */
+static void log_rotate(void)
+{
+    char old[PATH_MAX];
+    if (!logger.path || !logger.max_size || logger.size < logger.max_size)
+        return;
+    snprintf(old, sizeof(old), "%s.1", logger.path);
+    fflush(logger.file);
+    if (rename(logger.path, old) != 0 ||
+        !freopen(logger.path, "w", logger.file))
+    {
+        /* Keep appending to whatever is open */
+        logger.max_size = 0;
+        return;
+    }
+    /* The first line is the pid, see main() */
+    logger.size = fprintf(logger.file, "%d\n", getpid());
+}
+
+/* Write out everything in the ring, returns whether there was anything */
+static bool log_drain(void)
+{
+    bool any = false;
+    size_t dropped;
+    for (;;)
+    {
+        struct log_slot *slot = &logger.slots[logger.tail % LOG_SLOTS];
+        int len;
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+            logger.tail + 1)
+            break;
+        len = log_write(slot->dest, slot->time, slot->error, slot->text);
+        if (slot->dest == logger.file && len > 0)
+            logger.size += len;
+        /* Free the slot for the message LOG_SLOTS later */
+        atomic_store_explicit(&slot->seq, logger.tail + LOG_SLOTS,
+                              memory_order_release);
+        ++logger.tail;
+        any = true;
+        log_rotate();
+    }
+    if ((dropped = atomic_exchange(&logger.dropped, 0)) != 0 && logger.file)
+    {
+        char text[64];
+        snprintf(text, sizeof(text), "%zu messages dropped", dropped);
+        logger.size += log_write(logger.file, time(NULL), 1, text);
+    }
+    if (any)
+        fflush(NULL);
+    return any;
+}
+
+static void *log_flusher(void *unused)
+{
+    (void)unused;
+    while (!atomic_load(&logger.stopping))
+    {
+        if (log_drain())
+            continue;
+        pthread_mutex_lock(&logger.lock);
+        atomic_fetch_add(&logger.sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        /* A message could have come before sleepers was raised */
+        if (atomic_load_explicit(
+                &logger.slots[logger.tail % LOG_SLOTS].seq,
+                memory_order_acquire) != logger.tail + 1 &&
+            !atomic_load(&logger.stopping))
+            pthread_cond_wait(&logger.cond, &logger.lock);
+        atomic_fetch_sub(&logger.sleepers, 1);
+        pthread_mutex_unlock(&logger.lock);
+    }
+    log_drain();
+    return NULL;
+}
+
+/* Start the flusher. path and max_size rotate file, json selects the format.
+ * Returns 0 on success; messages are written synchronously otherwise */
+int log_start(FILE *file, const char *path, long max_size, bool json)
+{
+    size_t i;
+    int err;
+    sigset_t block, old;
+    for (i = 0; i < LOG_SLOTS; ++i)
+        atomic_init(&logger.slots[i].seq, i);
+    atomic_init(&logger.head, 0);
+    atomic_init(&logger.dropped, 0);
+    atomic_init(&logger.sleepers, 0);
+    atomic_init(&logger.stopping, false);
+    logger.tail = 0;
+    logger.json = json;
+    logger.file = file;
+    logger.path = path;
+    logger.max_size = max_size;
+    logger.size = ftell(file) > 0 ? ftell(file) : 0;
+    pthread_mutex_init(&logger.lock, NULL);
+    pthread_cond_init(&logger.cond, NULL);
+    /* The signals are to interrupt the waits of main(), so the flusher must
+     * never take them */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    err = pthread_create(&logger.thread, NULL, log_flusher, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+        return 1;
+    logger.running = true;
+    return 0;
+}
+
+/* Write out what is left and stop the flusher */
+void log_stop(void)
+{
+    if (!logger.running)
+        return;
+    atomic_store(&logger.stopping, true);
+    pthread_mutex_lock(&logger.lock);
+    pthread_cond_broadcast(&logger.cond);
+    pthread_mutex_unlock(&logger.lock);
+    pthread_join(logger.thread, NULL);
+    pthread_cond_destroy(&logger.cond);
+    pthread_mutex_destroy(&logger.lock);
+    logger.running = false;
+}
+
+static void log_message(FILE *dest, int error, const char *fmt, va_list ap)
+{
+    struct log_slot *slot;
+    size_t pos;
+    if (!logger.running)
+    {
+        char text[LOG_LINE];
+        vsnprintf(text, LOG_LINE, fmt, ap);
+        log_write(dest, time(NULL), error, text);
+        return;
+    }
+    /* Claim a slot, several threads may be at it */
+    pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    for (;;)
+    {
+        size_t seq;
+        slot = &logger.slots[pos % LOG_SLOTS];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(
+                    &logger.head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0)
+        {
+            /* Full, the flusher has not freed this slot yet */
+            atomic_fetch_add(&logger.dropped, 1);
+            return;
+        }
+        else
+            pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    }
+    slot->dest = dest;
+    slot->time = time(NULL);
+    slot->error = error;
+    vsnprintf(slot->text, LOG_LINE, fmt, ap);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    /* Order the store before the load of sleepers, pairs with the fence in
+     * log_flusher() */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&logger.sleepers))
+    {
+        pthread_mutex_lock(&logger.lock);
+        pthread_cond_broadcast(&logger.cond);
+        pthread_mutex_unlock(&logger.lock);
+    }
 }
 
 void aierror(FILE *dest, char *fmt, ...)
 {
     va_list ap;
-    char *cutime = getctime();
-    fprintf(dest, "(error)[%s] ", cutime);
     va_start(ap, fmt);
-    vfprintf(dest, fmt, ap);
+    log_message(dest, 1, fmt, ap);
     va_end(ap);
-    fprintf(dest, "\n");
-    free(cutime);
 }
 
 void aiinfo(FILE *dest, char *fmt, ...)
 {
     va_list ap;
-    char *cutime = getctime();
-    fprintf(dest, "(info)[%s] ", cutime);
     va_start(ap, fmt);
-    vfprintf(dest, fmt, ap);
+    log_message(dest, 0, fmt, ap);
     va_end(ap);
-    fprintf(dest, "\n");
-    free(cutime);
 }
 
 void git_usual_error(int error_code, FILE *log, const char *funcname)
@@ -131,88 +410,377 @@ void git_fatal_error(int error_code, FILE *log, const char *funcname)
     longjmp(exit_point, 2);
 }
 
-/* Change whenever you need another source */
-char *get_ip_by_curl()
+/* Used unless sources are given with -s. Each answers with the address
+ * somewhere in its body */
+static const char *const DEFAULT_SOURCES[] = {
+    "http://whois.pconline.com.cn/ipJson.jsp",
+    "https://api.ipify.org",
+    "https://icanhazip.com",
+};
+
+struct ip_source
 {
-    CURL *curl_handle;
-    CURLcode res;
+    char *url;
+    CURL *handle;
     struct MemoryStruct chunk;
-    char *tmp, *ip;
-    chunk.memory = malloc(1); /* will be grown as needed by the realloc above */
-    chunk.size = 0;           /* no data at this point */
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl_handle = curl_easy_init();
-    /* Set URL */
-    curl_easy_setopt(curl_handle, CURLOPT_URL,
-                     "http://whois.pconline.com.cn/ipJson.jsp");
-    /* Set memory callback */
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    /* Set output data */
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-    /* Set User-Agent */
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, UAGENT);
-    res = curl_easy_perform(curl_handle);
-    if (res != CURLE_OK)
+};
+
+/* IP sources queried together. The handles live as long as the program so
+ * that connections are kept alive between checks */
+struct ip_sources
+{
+    CURLM *multi;
+    struct ip_source *sources;
+    size_t count;
+};
+
+int ip_sources_init(struct ip_sources *s, char **urls, size_t count)
+{
+    size_t i;
+    s->count = 0;
+    if (!(s->multi = curl_multi_init()) ||
+        !(s->sources = calloc(count, sizeof(struct ip_source))))
+        return -1;
+    for (i = 0; i < count; ++i)
+    {
+        struct ip_source *src = &s->sources[i];
+        if (!(src->url = strdup(urls[i])) ||
+            !(src->handle = curl_easy_init()))
+        {
+            free(src->url);
+            return -1;
+        }
+        ++s->count;
+        curl_easy_setopt(src->handle, CURLOPT_URL, src->url);
+        curl_easy_setopt(src->handle, CURLOPT_WRITEFUNCTION,
+                         WriteMemoryCallback);
+        curl_easy_setopt(src->handle, CURLOPT_WRITEDATA, (void *)&src->chunk);
+        curl_easy_setopt(src->handle, CURLOPT_PRIVATE, (void *)src);
+        curl_easy_setopt(src->handle, CURLOPT_USERAGENT, UAGENT);
+        curl_easy_setopt(src->handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(src->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(src->handle, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(src->handle, CURLOPT_TIMEOUT, 15L);
+        /* Our signal handlers longjmp, curl should not play with them */
+        curl_easy_setopt(src->handle, CURLOPT_NOSIGNAL, 1L);
+    }
+    return 0;
+}
+
+void ip_sources_cleanup(struct ip_sources *s)
+{
+    size_t i;
+    for (i = 0; i < s->count; ++i)
     {
-        curl_easy_cleanup(curl_handle);
-        curl_global_cleanup();
+        curl_easy_cleanup(s->sources[i].handle);
+        free(s->sources[i].chunk.memory);
+        free(s->sources[i].url);
+    }
+    free(s->sources);
+    if (s->multi)
+        curl_multi_cleanup(s->multi);
+    s->sources = NULL;
+    s->multi = NULL;
+    s->count = 0;
+}
+
+/* Find the first IPv4 address in the body, or take the whole body as an
+ * IPv6 address */
+char *extract_ip(const char *body)
+{
+    char buf[INET6_ADDRSTRLEN];
+    unsigned char addr[sizeof(struct in6_addr)];
+    const char *p;
+    size_t len;
+    if (!body)
         return NULL;
+    for (p = body; *p; ++p)
+    {
+        if (!isdigit((unsigned char)*p) ||
+            (p != body && (isdigit((unsigned char)p[-1]) || p[-1] == '.')))
+            continue;
+        len = strspn(p, "0123456789.");
+        if (len < sizeof(buf))
+        {
+            memcpy(buf, p, len);
+            buf[len] = 0;
+            if (inet_pton(AF_INET, buf, addr) == 1)
+                return strdup(buf);
+        }
+        p += len - 1;
     }
-    else
+    p = body + strspn(body, " \t\r\n");
+    len = strcspn(p, " \t\r\n");
+    if (len && len < sizeof(buf))
     {
-        /* Get the fourth field */
-        tmp = strchr(chunk.memory, '"') + 1;
-        tmp = strchr(tmp, '"') + 1;
-        tmp = strchr(tmp, '"') + 1;
-        *(strchr(tmp, '"')) = 0;
-        ip = malloc(strlen(tmp) + 1);
-        strcpy(ip, tmp);
+        memcpy(buf, p, len);
+        buf[len] = 0;
+        if (inet_pton(AF_INET6, buf, addr) == 1)
+            return strdup(buf);
     }
-    /* cleanup curl stuff */
-    curl_easy_cleanup(curl_handle);
+    return NULL;
+}
 
-    free(chunk.memory);
+/* Ask all sources at once and take the first valid answer, cancelling the
+ * others */
+char *get_ip_by_curl(struct ip_sources *s, FILE *log)
+{
+    char *ip = NULL;
+    int running = 1, left;
+    size_t i;
+    CURLMsg *msg;
 
-    curl_global_cleanup();
+    for (i = 0; i < s->count; ++i)
+    {
+        s->sources[i].chunk.size = 0;
+        if (s->sources[i].chunk.memory)
+            s->sources[i].chunk.memory[0] = 0;
+        curl_multi_add_handle(s->multi, s->sources[i].handle);
+    }
+    while (!ip && running)
+    {
+        if (curl_multi_perform(s->multi, &running) != CURLM_OK)
+            break;
+        while (!ip && (msg = curl_multi_info_read(s->multi, &left)))
+        {
+            struct ip_source *src;
+            long code = 0;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                              (char **)&src);
+            if (msg->data.result != CURLE_OK)
+            {
+                aierror(log, "%s: %s", src->url,
+                        curl_easy_strerror(msg->data.result));
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            if (code != 200 || !(ip = extract_ip(src->chunk.memory)))
+                aierror(log, "%s: no address in the answer (HTTP %ld)",
+                        src->url, code);
+        }
+        if (!ip && running)
+            curl_multi_wait(s->multi, NULL, 0, 1000, NULL);
+    }
+    /* Removing the slower ones aborts their transfers */
+    for (i = 0; i < s->count; ++i)
+        curl_multi_remove_handle(s->multi, s->sources[i].handle);
     return ip;
 }
-void commit_changes(git_repository *repo, git_index *index, FILE *log)
+
+static long long now_ms(void)
 {
-    git_strarray strarray;
-    git_tree *old_tree, *tree;
-    git_commit *parent;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Open a socket notified of interface address changes, or return -1 where
+ * that is not supported */
+int open_addr_monitor(void)
+{
+#ifdef __linux__
+    struct sockaddr_nl addr;
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                    NETLINK_ROUTE);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* Drain the pending notifications. Returns whether any of them is about a
+ * global address */
+int read_addr_changes(int fd, FILE *log, int pinfo)
+{
+    int changed = 0;
+#ifdef __linux__
+    union
+    {
+        struct nlmsghdr align;
+        char buf[8192];
+    } msgs;
+    ssize_t len;
+    while ((len = recv(fd, msgs.buf, sizeof(msgs.buf), 0)) > 0)
+    {
+        struct nlmsghdr *nh;
+        for (nh = &msgs.align; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+        {
+            struct ifaddrmsg *ifa;
+            if (nh->nlmsg_type != RTM_NEWADDR && nh->nlmsg_type != RTM_DELADDR)
+                continue;
+            ifa = NLMSG_DATA(nh);
+            if (ifa->ifa_scope != RT_SCOPE_UNIVERSE)
+                continue;
+            if (pinfo)
+                aiinfo(log, "%s address on interface %u",
+                       nh->nlmsg_type == RTM_NEWADDR ? "New" : "Removed",
+                       ifa->ifa_index);
+            changed = 1;
+        }
+    }
+    /* Notifications were lost, one of them might have mattered */
+    if (len < 0 && errno == ENOBUFS)
+        changed = 1;
+#else
+    (void)fd;
+    (void)log;
+    (void)pinfo;
+#endif
+    return changed;
+}
+
+/* Wait up to `seconds`, or until a global address changes and no more
+ * changes follow for DEBOUNCE_MS */
+void wait_for_change(int fd, int seconds, FILE *log, int pinfo)
+{
+    /* poll() skips negative descriptors, so without a monitor this only
+     * sleeps */
+    struct pollfd pfd[2];
+    long long deadline = now_ms() + seconds * 1000LL, left;
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = quit_pipe[0];
+    pfd[1].events = POLLIN;
+    for (;;)
+    {
+        int ready;
+        if (quit_signal || (left = deadline - now_ms()) <= 0)
+            return;
+        ready = poll(pfd, 2, left);
+        if (ready < 0 && errno != EINTR)
+        {
+            sleepS(left / 1000 + 1);
+            return;
+        }
+        if (ready > 0 && (pfd[0].revents & POLLIN) &&
+            read_addr_changes(fd, log, pinfo))
+            break;
+    }
+    /* A renumbering usually comes as a burst */
+    deadline = now_ms() + SETTLE_MS;
+    while (!quit_signal && (left = deadline - now_ms()) > 0 &&
+           poll(pfd, 2, left < DEBOUNCE_MS ? left : DEBOUNCE_MS) > 0)
+        if (pfd[0].revents & POLLIN)
+            read_addr_changes(fd, log, pinfo);
+}
+
+/* Point the branch HEAD is on at `id` */
+void set_head(git_repository *repo, const git_oid *id, FILE *log)
+{
+    git_reference *head, *updated;
+    git_fatal_error(git_repository_head(&head, repo), log,
+                    "git_repository_head");
+    git_fatal_error(git_reference_set_target(&updated, head, id, "Update IP"),
+                    log, "git_reference_set_target");
+    git_reference_free(updated);
+    git_reference_free(head);
+}
+
+/* The commit made by commit_changes() that is not pushed yet */
+struct unpushed
+{
+    git_oid id;
+    /* What it was made on top of */
+    git_oid base;
+    int valid;
+};
+
+/* Whether HEAD has commits the remote does not, as far as
+ * refs/remotes/origin/master tells. Without that ref only a commit of
+ * ours counts */
+static int head_unpushed(git_repository *repo, const struct unpushed *ours,
+                         FILE *log)
+{
+    git_oid head, remote;
+    git_fatal_error(git_reference_name_to_id(&head, repo, "HEAD"), log,
+                    "git_reference_name_to_id");
+    if (git_reference_name_to_id(&remote, repo,
+                                 "refs/remotes/origin/master") != 0)
+        return ours->valid;
+    return !git_oid_equal(&head, &remote);
+}
+
+/* Commit a README containing ip on top of HEAD. The tree is that of HEAD
+ * with one entry replaced, so neither the index nor the working tree is read
+ * or written. If HEAD is still our unpushed commit, it is replaced rather
+ * than built upon, so however often the address flaps, there is at most one
+ * commit of ours to push; commits made by anyone else are kept.
+ * Returns 1 if HEAD now has something to push */
+int commit_changes(git_repository *repo, struct unpushed *ours,
+                   const char *ip, FILE *log)
+{
+    git_tree *base_tree, *tree;
+    git_commit *base;
+    const git_commit *parents[1];
+    git_treebuilder *builder;
     git_signature *author;
-    git_oid tree_id, parent_id, commit_id;
-    char *pathspec = "*";
-    strarray.strings = (char **)malloc(sizeof(char *));
-    strarray.strings[0] = pathspec;
-    strarray.count = 1;
+    git_oid head_id, blob_id, tree_id, commit_id;
+    const git_oid *base_id = &head_id;
+    int changed;
 
-    git_fatal_error(git_index_add_all(index, &strarray, 0, NULL, NULL), log,
-                    "git_index_add_all");
-    git_fatal_error(git_index_write(index), log, "git_index_write");
-    git_fatal_error(git_index_write_tree(&tree_id, index), log,
-                    "git_index_write_tree");
-    git_index_free(index);
-    git_fatal_error(git_tree_lookup(&tree, repo, &tree_id), log,
-                    "git-tree_lookup");
-
-    git_fatal_error(git_reference_name_to_id(&parent_id, repo, "HEAD"), log,
-                    "git_reference_name_to_oid");
-    git_fatal_error(git_commit_lookup(&parent, repo, &parent_id), log,
+    git_fatal_error(git_reference_name_to_id(&head_id, repo, "HEAD"), log,
+                    "git_reference_name_to_id");
+    if (ours->valid && git_oid_equal(&head_id, &ours->id))
+        base_id = &ours->base;
+    else
+        ours->valid = 0;
+    git_fatal_error(git_commit_lookup(&base, repo, base_id), log,
                     "git_commit_lookup");
+    git_fatal_error(git_commit_tree(&base_tree, base), log, "git_commit_tree");
+    git_fatal_error(git_blob_create_frombuffer(&blob_id, repo, ip, strlen(ip)),
+                    log, "git_blob_create_frombuffer");
+    git_fatal_error(git_treebuilder_new(&builder, repo, base_tree), log,
+                    "git_treebuilder_new");
+    git_fatal_error(git_treebuilder_insert(NULL, builder, "README", &blob_id,
+                                           GIT_FILEMODE_BLOB),
+                    log, "git_treebuilder_insert");
+    git_fatal_error(git_treebuilder_write(&tree_id, builder), log,
+                    "git_treebuilder_write");
+    git_treebuilder_free(builder);
 
-    git_fatal_error(git_signature_default(&author, repo), log,
-                    "git_signature_default");
-
-    git_fatal_error(git_commit_create_v(&commit_id, repo, "HEAD", author,
-                                        author, NULL, "Update IP", tree, 1,
-                                        parent),
-                    log, "git_commit_create_v");
+    changed = !git_oid_equal(&tree_id, git_tree_id(base_tree));
+    if (changed)
+    {
+        git_fatal_error(git_tree_lookup(&tree, repo, &tree_id), log,
+                        "git_tree_lookup");
+        git_fatal_error(git_signature_default(&author, repo), log,
+                        "git_signature_default");
+        parents[0] = base;
+        /* HEAD may be our commit that is not `base`, so move it ourselves
+         * instead of having the commit update it */
+        git_fatal_error(git_commit_create(&commit_id, repo, NULL, author,
+                                          author, NULL, "Update IP", tree, 1,
+                                          parents),
+                        log, "git_commit_create");
+        set_head(repo, &commit_id, log);
+        ours->base = *base_id;
+        ours->id = commit_id;
+        ours->valid = 1;
+        git_signature_free(author);
+        git_tree_free(tree);
+    }
+    else if (ours->valid)
+    {
+        /* Back to what we built on, drop our unpushed commit */
+        set_head(repo, &ours->base, log);
+        ours->valid = 0;
+    }
 
-    git_signature_free(author);
-    git_tree_free(tree);
-    git_commit_free(parent);
+    git_tree_free(base_tree);
+    git_commit_free(base);
+    return head_unpushed(repo, ours, log);
 }
 
 int cred_cb(git_cred **out, const char *url, const char *username_from_url,
@@ -248,13 +816,30 @@ int main(int argc, char **argv)
     char *current_ip, *old_ip = NULL;
     int opt;
     int check = 1;
-    int pinfo = 1, sleeptime = 60;
+    int pinfo = 1, sleeptime = 0;
+    int monitor = -1;
+    bool json = false;
+    long max_log = 0;
     char *siteddnsdir = NULL;
-    const char *opts = ":ovqrht:d:";
+    const char *opts = ":ovqrjht:d:s:m:";
     int error;
     git_repository *siteddns = NULL;
-    git_index *index = NULL;
+    git_oid remote;
+    struct unpushed ours;
+    int pending = 0;
+    long long push_at = 0, pushed_at;
+    struct ip_sources sources = {NULL, NULL, 0};
+    char **urls = NULL;
+    size_t nurls = 0;
 
+    if (pipe(quit_pipe) == 0)
+    {
+        fcntl(quit_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(quit_pipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl(quit_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    else
+        quit_pipe[0] = quit_pipe[1] = -1;
     signal(SIGINT, rlae);
     signal(SIGTERM, rlae);
     signal(SIGQUIT, rlae);
@@ -282,12 +867,29 @@ int main(int argc, char **argv)
                     "-v: print version\n"
                     "-q: disable infomations\n"
                     "-h: print this\n"
-                    "-t SEC: set waiting time in seconds after each check[60]\n"
-                    "-d DIR: set siteddns dir\n");
+                    "-t SEC: check at least every SEC seconds[600, or 60 if\n"
+                    "        address changes cannot be watched]\n"
+                    "-d DIR: set siteddns dir\n"
+                    "-s URL: ask URL for the IP, can be repeated; all are\n"
+                    "        asked at once and the first answer wins\n"
+                    "-j: log JSON lines\n"
+                    "-m KIB: start a new log file when it reaches KIB KiB,\n"
+                    "        keeping the old one as " LFILE ".1[never]\n");
                 goto exithere;
             case 'r':
                 check = 0;
                 break;
+            case 'j':
+                json = true;
+                break;
+            case 'm':
+                max_log = atol(optargGS) * 1024;
+                if (max_log <= 0)
+                {
+                    fprintf(stderr, "-m: must be positive\n");
+                    goto exithere;
+                }
+                break;
             case 't':
                 sleeptime = atoi(optargGS);
                 if (sleeptime < 10)
@@ -300,6 +902,18 @@ int main(int argc, char **argv)
                 siteddnsdir = malloc(strlen(optargGS) + 1);
                 strcpy(siteddnsdir, optargGS);
                 break;
+            case 's':
+            {
+                char **tmp = realloc(urls, (nurls + 1) * sizeof(char *));
+                if (!tmp)
+                {
+                    fprintf(stderr, "realloc failed\n");
+                    goto exithere;
+                }
+                urls = tmp;
+                urls[nurls++] = optargGS;
+                break;
+            }
             case ':':
                 fprintf(stderr, "-%c: argument expected\n", optoptGS);
                 goto exithere;
@@ -342,25 +956,47 @@ int main(int argc, char **argv)
             log = stdout;
         }
     }
+    /* Also the lock, see above */
+    fprintf(log, "%d\n", getpid());
+    if (log_start(log, log == stdout ? NULL : LFILE, max_log, json))
+        fprintf(stderr, "Cannot start the logger, logging synchronously\n");
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (nurls == 0
+            ? ip_sources_init(&sources, (char **)DEFAULT_SOURCES,
+                              sizeof(DEFAULT_SOURCES) / sizeof(char *))
+            : ip_sources_init(&sources, urls, nurls))
+    {
+        fprintf(stderr, "curl initialization failed\n");
+        goto exithere;
+    }
+
+    /* Address changes trigger a check, polling is only the fallback */
+    if ((monitor = open_addr_monitor()) < 0 && pinfo)
+        fprintf(stderr, "Cannot watch address changes, polling\n");
+    if (sleeptime == 0)
+        sleeptime = monitor < 0 ? 60 : 600;
 
     git_libgit2_init();
     error = git_repository_open(&siteddns, siteddnsdir);
     git_fatal_error(error, log, "git_repository_open");
-    error = git_repository_index(&index, siteddns);
-    git_fatal_error(error, log, "git_repository_index");
-
-    fprintf(log, "%d\n", getpid());
+    if (git_reference_name_to_id(&remote, siteddns,
+                                 "refs/remotes/origin/master") != 0)
+        aierror(log, "no origin/master, only pushing commits of this run");
+    ours.valid = 0;
 
+    /* So that the first change is pushed at once */
+    pushed_at = now_ms() - PUSH_DELAY_MS;
     if (setjmp(exit_point) == 2)
         goto exithere;
-    for (;;)
+    while (!quit_signal)
     {
         if (pinfo)
             aiinfo(log, "Fetching");
-        if ((current_ip = get_ip_by_curl()) == NULL)
+        if ((current_ip = get_ip_by_curl(&sources, log)) == NULL)
         {
-            aierror(log, "curl_easy_perform() failed\n");
-            sleepS(20);
+            aierror(log, "no IP source answered");
+            wait_for_change(monitor, 20, log, pinfo);
             continue;
         }
         if (pinfo)
@@ -370,21 +1006,29 @@ int main(int argc, char **argv)
         }
         if (!old_ip || strcmp(current_ip, old_ip) != 0)
         {
-            FILE *siteddnsfil;
-            pid_t pid;
-            int stat;
+            int changed;
             if (pinfo)
                 aiinfo(log, "Publish");
-            if ((siteddnsfil = fopen(SITEDDNS "/README", "w")) == NULL)
-            {
-                aierror(log, "fopen failed for README: %s", strerror(errno));
-
-                goto exithere;
-            }
-            fputs(current_ip, siteddnsfil);
-            fclose(siteddnsfil);
-            commit_changes(siteddns, index, log);
+            /* The first check also finds commits left unpushed by an
+             * earlier run */
+            changed = commit_changes(siteddns, &ours, current_ip, log);
+            /* Pushed at once unless the last push was just now, then the
+             * changes until the window ends ride along */
+            if (changed && !pending)
+                push_at = pushed_at + PUSH_DELAY_MS;
+            else if (!changed && pending && pinfo)
+                aiinfo(log, "Changed back before the push");
+            pending = changed;
+        }
+        if (pending && now_ms() >= push_at)
+        {
+            if (pinfo)
+                aiinfo(log, "Push");
             push_refs(siteddns, log);
+            pushed_at = now_ms();
+            /* On the remote now, later changes go on top of it */
+            ours.valid = 0;
+            pending = 0;
         }
         if (old_ip)
             free(old_ip);
@@ -393,13 +1037,21 @@ int main(int argc, char **argv)
         free(current_ip);
         if (pinfo)
             aiinfo(log, "Suspend");
-        sleepS(60);
+        wait_for_change(monitor,
+                        pending ? (int)((push_at - now_ms() + 999) / 1000)
+                                : sleeptime,
+                        log, pinfo);
     }
+    aiinfo(log, "catch signal %d, exiting", (int)quit_signal);
 exithere:
+    if (monitor >= 0)
+        close(monitor);
+    ip_sources_cleanup(&sources);
+    curl_global_cleanup();
+    free(urls);
+    log_stop();
     if (log && log != stdout)
         fclose(log);
-    if (index)
-        git_index_free(index);
     if (siteddns)
         git_repository_free(siteddns);
     if (siteddnsdir)
@@ -1,5 +1,9 @@
 /* Print numbers that their nth root, n_2th root,... are all an integer
  * like 4096, 262144, 729 for 2 and 3
+ * The numbers are produced in ascending order without duplicates by merging
+ * one stream of b^e per exponent e = multiple * power with a min-heap.
+ * All arithmetic is done with exact 64-bit integers, so everything up to
+ * 2^64 - 1 is printed exactly.
  */
 /*
  *  cnsroot.c
@@ -19,27 +23,101 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <math.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <slib/getopt.h>
 #include <slib/math.h>
+
+/* One ascending stream of base^exponent */
+struct stream
+{
+    uint64_t value;
+    uint64_t base;
+    unsigned long exponent;
+};
+
+/* Exact base^exp. Returns false if the result does not fit in 64 bits */
+static bool ipow(uint64_t base, unsigned long exp, uint64_t *result)
+{
+    uint64_t r = 1;
+    while (exp)
+    {
+        if (exp & 1)
+        {
+            if (base && r > UINT64_MAX / base)
+                return false;
+            r *= base;
+        }
+        exp >>= 1;
+        if (exp)
+        {
+            if (base && base > UINT64_MAX / base)
+                return false;
+            base *= base;
+        }
+    }
+    *result = r;
+    return true;
+}
+
+/* Move a stream to its next base. Returns false if it is exhausted */
+static bool advance(struct stream *s, uint64_t bmax, uint64_t nmax)
+{
+    if (s->base >= bmax)
+        return false;
+    s->base += 1;
+    if (!ipow(s->base, s->exponent, &s->value))
+        return false;
+    return s->value <= nmax;
+}
+
+static void sift_down(struct stream *heap, size_t n, size_t i)
+{
+    while (true)
+    {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        struct stream tmp;
+        if (l < n && heap[l].value < heap[m].value)
+            m = l;
+        if (r < n && heap[r].value < heap[m].value)
+            m = r;
+        if (m == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+        i = m;
+    }
+}
+
 int main(int argc, char **argv)
 {
     struct optionGS options[] = {{"base-max", 1, NULL, 'b'},
                                  {"power-max", 1, NULL, 'p'},
                                  {"add-multiple", 1, NULL, 'm'},
+                                 {"limit", 1, NULL, 'n'},
                                  {"help", 0, NULL, 'h'},
                                  {NULL, 0, NULL, 0}};
-    char *sopts = ":b:p:m:h";
+    char *sopts = ":b:p:m:n:h";
     int opt;
-    unsigned long multiple = 1, bmax = 3, pmax = 3;
+    bool bset = false;
+    unsigned long multiple = 1, pmax = 3;
+    uint64_t bmax = 3, nmax = UINT64_MAX;
+    struct stream *heap;
+    size_t nheap = 0;
+    unsigned long power;
+    uint64_t last;
     while ((opt = getopt_longGS(argc, argv, sopts, options, NULL)) != -1)
     {
         switch (opt)
         {
             case 'b':
-                bmax = atol(optargGS);
+                bmax = strtoull(optargGS, NULL, 0);
+                bset = true;
                 break;
             case 'p':
                 pmax = atol(optargGS);
@@ -47,11 +125,18 @@ int main(int argc, char **argv)
             case 'm':
                 multiple = slib_lcm(multiple, atol(optargGS));
                 break;
+            case 'n':
+                nmax = strtoull(optargGS, NULL, 0);
+                /* Unless specified, -n alone lifts the limit on the base */
+                if (!bset)
+                    bmax = UINT64_MAX;
+                break;
             case 'h':
                 printf("Options:\n"
                        "-b, --base-max ARG: maximum of the base\n"
                        "-p, --power-max ARG: maximum of power/multiple\n"
                        "-m, --add-multiple ARG: add a multiple\n"
+                       "-n, --limit ARG: maximum of the printed numbers\n"
                        "-h, --help: show this\n");
                 exit(0);
             case ':':
@@ -62,9 +147,60 @@ int main(int argc, char **argv)
                 exit(1);
         }
     }
-    unsigned long base, power;
-    for (base = 0; base <= bmax; ++base)
-        for (power = 0; power <= pmax; ++power)
-            printf("%ld\n", (long)pow(base, multiple * power));
+    if (multiple == 0)
+    {
+        printf("multiple cannot be zero\n");
+        exit(1);
+    }
+
+    /* 0 and 1 are any power of themselves, and 1 is also b^0 */
+    if (pmax > 0)
+        printf("0\n");
+    if (nmax < 1)
+        return 0;
+    printf("1\n");
+    if (nmax < 2 || bmax < 2)
+        return 0;
+
+    heap = malloc(sizeof(struct stream) * (pmax ? pmax : 1));
+    if (!heap)
+    {
+        printf("malloc failed\n");
+        exit(1);
+    }
+    /* Start each stream at base 2 */
+    for (power = 1; power <= pmax; ++power)
+    {
+        struct stream s;
+        if (multiple > ULONG_MAX / power)
+            break;
+        s.exponent = multiple * power;
+        s.base = 1;
+        if (!advance(&s, bmax, nmax))
+            /* Larger exponents only give larger values */
+            break;
+        heap[nheap++] = s;
+    }
+    {
+        size_t i = nheap / 2;
+        while (i-- > 0)
+            sift_down(heap, nheap, i);
+    }
+
+    last = 1;
+    while (nheap)
+    {
+        /* Values shared by several streams (2^6 = 4^3 = 8^2) come out
+         * adjacently, so only one of them is printed */
+        if (heap[0].value != last)
+        {
+            last = heap[0].value;
+            printf("%" PRIu64 "\n", last);
+        }
+        if (!advance(&heap[0], bmax, nmax))
+            heap[0] = heap[--nheap];
+        sift_down(heap, nheap, 0);
+    }
+    free(heap);
     return 0;
 }
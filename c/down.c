@@ -1,4 +1,4 @@
-/* Multi thread map tiles downloader using OpenMP and libcurl */
+/* Concurrent map tiles downloader using libcurl's multi interface */
 /* Parameters:
  * MAXZOOM: maximum zoom level
  * MINZOOM: minimum zoom level
@@ -6,6 +6,11 @@
  * URLBASE: the url without /{z}/{x}/{y}.png part
  * URLARGS: GET arguments for things like apikey
  * USRAGNT: User-Agent
+ * MAXCONN: default number of tiles in flight
+ * RETRIES: tries again after a 429, 5xx or network error before giving up
+ * SYNTH_BATCH: tiles made at once by -s, which are held in memory
+ * MANIFEST: what is known of the downloaded tiles, relative to BASEDIR;
+ *           with -a, it is the archive name followed by .MANIFEST
  * Maximum zoom level is 21
  * Only URLs like http://example.com/{z}/{x}/{y}.png are supported
  */
@@ -28,10 +33,25 @@
  */
 
 #include <curl/curl.h>
-#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <png.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <math.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define MAXZOOM 1
 #define MINZOOM 0
@@ -41,79 +61,2237 @@
 #define USRAGNT                                                                \
     "Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:58.0) Gecko/20100101 "         \
     "Firefox/58.0"
+#define MAXCONN 64
+#define RETRIES 5
+#define SYNTH_BATCH 1024
+#define MANIFEST "manifest"
+/* Longest ETag kept, with its terminator */
+#define ETAG_SIZE 128
+#define ARCHIVE_MAGIC "DOWNTILE"
+#define ARCHIVE_INDEX_MAGIC "TILEINDX"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_RECORD_MAGIC 0x454c4954
+#define ARCHIVE_REF_MAGIC 0x46455254
 
-size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream)
+/* A tile as it arrives */
+struct buffer
 {
-    size_t written = fwrite(ptr, size, nmemb, stream);
-    return written;
-}
+    char *data;
+    size_t size;
+    size_t alloc;
+};
+
+/* What was last downloaded of a tile */
+struct manifest_entry
+{
+    /* From tile_key(), 0 for an empty slot */
+    uint64_t key;
+    uint64_t hash;
+    long size;
+    /* Last-Modified, -1 if unknown */
+    long mtime;
+    /* ETag, NULL if none */
+    char *etag;
+    /* Stored by this run */
+    int fresh;
+};
+
+/* The manifest is kept in memory as an open-addressing hash table, and on
+ * disk as a log that every stored tile is appended to, so an interrupted run
+ * knows what it has done. It is rewritten without the superseded lines at
+ * the end of a run */
+struct manifest
+{
+    struct manifest_entry *entries;
+    size_t count;
+    size_t alloc;
+    FILE *log;
+    char *path;
+};
+
+/* Archives keep all the tiles in one file, in native byte order:
+ *   header   ARCHIVE_MAGIC, u32 ARCHIVE_VERSION, u32 0
+ *   records  struct archive_record then the tile padded to 8 bytes, in the
+ *            order they arrived; a tile already in the archive is instead
+ *            a record with ARCHIVE_REF_MAGIC then the u64 offset of the
+ *            earlier copy
+ *   index    struct archive_entry sorted by key, one per tile
+ *   footer   struct archive_footer
+ * Records describe themselves, so the index of an archive that was not
+ * closed is made again by walking them */
+struct archive_record
+{
+    uint64_t key;
+    uint32_t size;
+    uint32_t magic;
+};
+
+struct archive_entry
+{
+    uint64_t key;
+    /* Of the tile itself, after its record */
+    uint64_t offset;
+    uint32_t size;
+    /* 0 in the file, the order of the entries while sorting */
+    uint32_t reserved;
+};
+
+struct archive_footer
+{
+    uint64_t index;
+    uint64_t count;
+    char magic[8];
+};
+
+/* An archive mapped for reading */
+struct tile_archive
+{
+    const char *map;
+    size_t size;
+    const struct archive_entry *index;
+    size_t count;
+};
+
+/* A stored copy of some content */
+struct dedup_entry
+{
+    /* From tile_hash(), 0 for an empty slot */
+    uint64_t hash;
+    uint64_t key;
+    /* In the archive */
+    uint64_t offset;
+    uint32_t size;
+};
+
+/* Where tiles go: BASEDIR/z/x/y.png, or an archive being written */
+struct store
+{
+    FILE *archive;
+    /* Tiles in the archive, those of earlier runs first and sorted */
+    struct archive_entry *index;
+    size_t count;
+    size_t sorted;
+    size_t alloc;
+    /* Where the next record goes */
+    uint64_t end;
+    /* Tiles by content, so that each is kept only once */
+    struct dedup_entry *dedup;
+    size_t ndedup;
+    size_t dedup_alloc;
+    long duplicates;
+    unsigned long long saved;
+};
 
-int main(void)
+/* One tile in flight. The handles are kept between tiles so that their
+ * connections and TLS sessions are reused */
+struct transfer
 {
-    long long maxtile;
-    char *URI = malloc(1 + strlen(URLBASE "/XX/XXXXXXX/"
-                                          "XXXXXXX.png" URLARGS));
-    char *DEST =
-        malloc(sizeof(char) * (1 + strlen(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")));
-    char *firstdir = malloc(1 + strlen(BASEDIR "/XX"));
-    char *secdir = malloc(1 + strlen(BASEDIR "/XX/XXXXXXX"));
     CURL *curl;
-    FILE *out;
-    CURLcode res;
-    curl = curl_easy_init();
-    if (curl == NULL)
+    struct buffer body;
+    struct curl_slist *headers;
+    int z;
+    long x, y;
+    /* Tries before this one */
+    int attempt;
+    /* Seconds to wait before the next try */
+    double delay;
+    char url[sizeof(URLBASE "/XX/XXXXXXX/XXXXXXX.png" URLARGS)];
+    char etag[ETAG_SIZE];
+};
+
+/* How hard the server is pushed. The tiles in flight grow by one per tile
+ * until the first sign of overload, then by one per window of that many
+ * tiles; overload cuts them at most once per window. Overload is a 429 or
+ * 5xx, a network error, or latency past twice the best seen. A token bucket
+ * caps the request rate if asked to, and Retry-After stops all requests */
+struct limiter
+{
+    double limit;
+    int max;
+    int slow_start;
+    /* Tiles finished since the last cut */
+    long since_cut;
+    /* Smoothed and best latency, in seconds */
+    double latency;
+    double best;
+    /* Requests per second, 0 for no limit */
+    double rate;
+    double tokens;
+    /* Times as from now() */
+    double refilled;
+    double paused_until;
+};
+
+/* A tile waiting to be tried again */
+struct retry
+{
+    int z;
+    long x, y;
+    int attempt;
+    double due;
+};
+
+struct retry_queue
+{
+    struct retry *items;
+    size_t count;
+    size_t alloc;
+};
+
+/* Area to download, as rings of edges in Web Mercator coordinates, where
+ * the world is [0, 1] x [0, 1] with y growing southwards. A point is in the
+ * region if it is inside an odd number of rings, so holes work */
+struct edge
+{
+    double x0, y0, x1, y1;
+};
+
+struct region
+{
+    struct edge *edges;
+    size_t count;
+    size_t alloc;
+};
+
+/* Tiles from MINZOOM to maxzoom that touch the region, made as they are
+ * needed by walking down the quadtree. Tiles entirely outside are not
+ * entered; tiles entirely inside need no more tests. Each level keeps the
+ * edges crossing the tile being walked, and its children only test those */
+struct tile_iter
+{
+    const struct region *region;
+    struct
     {
-        fprintf(stderr, "Curl init error\n");
-        free(URI);
-        free(DEST);
-        free(firstdir);
-        free(secdir);
-        exit(1);
-    }
-    mkdir(BASEDIR, 0755);
-#pragma omp parallel for
-    for (int i = MINZOOM; i <= MAXZOOM; ++i)
-    {
-        sprintf(firstdir, BASEDIR "/%d", i);
-        mkdir(firstdir, 0755);
-        maxtile = pow(2, i);
-        for (int long j = 0; j < maxtile; ++j)
-        {
-            sprintf(secdir, BASEDIR "/%d/%ld", i, j);
-            mkdir(secdir, 0755);
-            for (long int k = 0; k < maxtile; ++k)
-            {
-                printf("%d/%ld/%ld\n", i, j, k);
-                sprintf(URI,
-                        URLBASE "/%d/%ld/"
-                                "%ld.png" URLARGS,
-                        i, j, k);
-                sprintf(DEST, BASEDIR "/%d/%ld/%ld.png", i, j, k);
-                out = fopen(DEST, "wb");
-                if (out == NULL)
+        int z;
+        long x, y;
+        int inside;
+    } stack[3 * (MAXZOOM + 1) + 1];
+    int depth;
+    int maxzoom;
+    size_t *edges[MAXZOOM + 1];
+    size_t nedges[MAXZOOM + 1];
+};
+
+/* A tile made from its four children, given in the order next_tile() gives
+ * them: x offset in the high bit, y offset in the low bit */
+struct synth_job
+{
+    int z;
+    long x, y;
+    /* -1 for a missing child */
+    long size[4];
+    /* In the archive */
+    uint64_t offset[4];
+    /* The PNG made, NULL if it failed */
+    unsigned char *png;
+    size_t png_size;
+};
+
+/* A batch of tiles shared by the workers */
+struct synth
+{
+    /* Of the archive, -1 for BASEDIR */
+    int fd;
+    struct synth_job *jobs;
+    size_t count;
+    atomic_size_t next;
+};
+
+static double lon_x(double lon)
+{
+    return (lon + 180) / 360;
+}
+
+static double lat_y(double lat)
+{
+    /* Where Web Mercator ends */
+    lat = lat > 85.0511287798 ? 85.0511287798
+          : lat < -85.0511287798 ? -85.0511287798
+                                 : lat;
+    lat *= M_PI / 180;
+    return (1 - log(tan(lat) + 1 / cos(lat)) / M_PI) / 2;
+}
+
+static int region_add(struct region *r, double lon0, double lat0, double lon1,
+                      double lat1)
+{
+    if (r->count == r->alloc)
+    {
+        size_t alloc = r->alloc ? 2 * r->alloc : 64;
+        struct edge *edges = realloc(r->edges, sizeof(struct edge) * alloc);
+        if (!edges)
+            return 1;
+        r->edges = edges;
+        r->alloc = alloc;
+    }
+    r->edges[r->count].x0 = lon_x(lon0);
+    r->edges[r->count].y0 = lat_y(lat0);
+    r->edges[r->count].x1 = lon_x(lon1);
+    r->edges[r->count].y1 = lat_y(lat1);
+    ++r->count;
+    return 0;
+}
+
+static int region_rect(struct region *r, double west, double south,
+                       double east, double north)
+{
+    return region_add(r, west, south, east, south) ||
+           region_add(r, east, south, east, north) ||
+           region_add(r, east, north, west, north) ||
+           region_add(r, west, north, west, south);
+}
+
+/* Parse "WEST,SOUTH,EAST,NORTH" in degrees */
+static int region_bbox(struct region *r, const char *bbox)
+{
+    double west, south, east, north;
+    if (sscanf(bbox, "%lf,%lf,%lf,%lf", &west, &south, &east, &north) != 4 ||
+        west < -180 || east > 180 || west > 180 || east < -180 ||
+        south >= north)
+        return 1;
+    /* Across the antimeridian */
+    if (west > east)
+        return region_rect(r, west, south, 180, north) ||
+               region_rect(r, -180, south, east, north);
+    return region_rect(r, west, south, east, north);
+}
+
+/* Take the rings of every "coordinates" in a GeoJSON file, which makes the
+ * union of its Polygons and MultiPolygons if they do not overlap */
+static int region_geojson(struct region *r, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    char *text = NULL, *p;
+    long len;
+    if (!fp)
+        return 1;
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0 || !(text = malloc(len + 1)) ||
+        fread(text, 1, len, fp) != (size_t)len)
+    {
+        free(text);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    text[len] = 0;
+    for (p = text; (p = strstr(p, "\"coordinates\""));)
+    {
+        /* Numbers of the innermost array, and the ring so far */
+        double point[2], first[2] = {0, 0}, last[2] = {0, 0};
+        int depth = 0, npoint = 0, nring = 0;
+        p += sizeof("\"coordinates\"") - 1;
+        while (*p && *p != '[')
+            ++p;
+        do
+        {
+            if (*p == '[')
+            {
+                ++depth;
+                npoint = 0;
+                ++p;
+            }
+            else if (*p == ']')
+            {
+                --depth;
+                ++p;
+                if (npoint >= 2)
                 {
-                    fprintf(stderr, "fopen error at %d/%ld/%ld\n", i, j, k);
-                    free(URI);
-                    free(DEST);
-                    free(firstdir);
-                    free(secdir);
-                    curl_easy_cleanup(curl);
-                    exit(1);
+                    /* A position */
+                    if (nring && region_add(r, last[0], last[1], point[0],
+                                            point[1]))
+                        goto fail;
+                    if (!nring++)
+                        memcpy(first, point, sizeof(first));
+                    memcpy(last, point, sizeof(last));
                 }
-                curl_easy_setopt(curl, CURLOPT_URL, URI);
-                curl_easy_setopt(curl, CURLOPT_WRITEDATA, out);
-                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-                curl_easy_setopt(curl, CURLOPT_USERAGENT, USRAGNT);
-                res = curl_easy_perform(curl);
-                fclose(out);
+                else if (nring)
+                {
+                    /* The end of a ring, closed if it was not */
+                    if ((first[0] != last[0] || first[1] != last[1]) &&
+                        region_add(r, last[0], last[1], first[0], first[1]))
+                        goto fail;
+                    nring = 0;
+                }
+                npoint = 0;
+            }
+            else if (*p == '-' || *p == '.' || (*p >= '0' && *p <= '9'))
+            {
+                char *end;
+                double v = strtod(p, &end);
+                /* Like a lone "-", not a number after all */
+                if (end == p)
+                    goto fail;
+                p = end;
+                if (npoint < 2)
+                    point[npoint] = v;
+                ++npoint;
+            }
+            else if (*p)
+                ++p;
+        } while (*p && depth > 0);
+    }
+    free(text);
+    return r->count == 0;
+
+fail:
+    free(text);
+    return 1;
+}
+
+/* Whether an edge touches the rectangle, by Liang-Barsky clipping */
+static int edge_crosses(const struct edge *e, double x0, double y0,
+                        double x1, double y1)
+{
+    double p[4], q[4], t0 = 0, t1 = 1;
+    int i;
+    p[0] = e->x0 - e->x1;
+    q[0] = e->x0 - x0;
+    p[1] = e->x1 - e->x0;
+    q[1] = x1 - e->x0;
+    p[2] = e->y0 - e->y1;
+    q[2] = e->y0 - y0;
+    p[3] = e->y1 - e->y0;
+    q[3] = y1 - e->y0;
+    for (i = 0; i < 4; ++i)
+    {
+        if (p[i] == 0)
+        {
+            if (q[i] < 0)
+                return 0;
+        }
+        else
+        {
+            double t = q[i] / p[i];
+            if (p[i] < 0 ? t > t1 : t < t0)
+                return 0;
+            if (p[i] < 0 && t > t0)
+                t0 = t;
+            else if (p[i] > 0 && t < t1)
+                t1 = t;
+        }
+    }
+    return 1;
+}
+
+/* Whether a point is in the region, by the even-odd rule */
+static int region_contains(const struct region *r, double x, double y)
+{
+    int inside = 0;
+    size_t i;
+    for (i = 0; i < r->count; ++i)
+    {
+        const struct edge *e = &r->edges[i];
+        if ((e->y0 > y) != (e->y1 > y) &&
+            x < e->x0 + (y - e->y0) * (e->x1 - e->x0) / (e->y1 - e->y0))
+            inside = !inside;
+    }
+    return inside;
+}
+
+/* Start walking the tiles touching region, or all tiles if it is NULL, down
+ * to maxzoom */
+static int tile_iter_init(struct tile_iter *it, const struct region *region,
+                          int maxzoom)
+{
+    int z;
+    it->region = region;
+    it->depth = 1;
+    it->maxzoom = maxzoom;
+    it->stack[0].z = 0;
+    it->stack[0].x = 0;
+    it->stack[0].y = 0;
+    it->stack[0].inside = !region;
+    for (z = 0; z <= MAXZOOM; ++z)
+    {
+        it->edges[z] = NULL;
+        it->nedges[z] = 0;
+    }
+    for (z = 0; region && z <= MAXZOOM; ++z)
+        if (!(it->edges[z] = malloc(sizeof(size_t) * region->count)))
+            return 1;
+    return 0;
+}
+
+static void tile_iter_free(struct tile_iter *it)
+{
+    int z;
+    for (z = 0; z <= MAXZOOM; ++z)
+        free(it->edges[z]);
+}
+
+static int next_tile(struct tile_iter *it, int *z, long *x, long *y)
+{
+    while (it->depth)
+    {
+        int tz, inside, i;
+        long tx, ty;
+        --it->depth;
+        tz = it->stack[it->depth].z;
+        tx = it->stack[it->depth].x;
+        ty = it->stack[it->depth].y;
+        inside = it->stack[it->depth].inside;
+        if (!inside)
+        {
+            double size = 1.0 / (1L << tz), x0 = tx * size, y0 = ty * size;
+            size_t j, n = tz ? it->nedges[tz - 1] : it->region->count;
+            it->nedges[tz] = 0;
+            for (j = 0; j < n; ++j)
+            {
+                size_t edge = tz ? it->edges[tz - 1][j] : j;
+                if (edge_crosses(&it->region->edges[edge], x0, y0, x0 + size,
+                                 y0 + size))
+                    it->edges[tz][it->nedges[tz]++] = edge;
+            }
+            /* Nothing crosses the tile, so it is all in or all out */
+            if (it->nedges[tz] == 0)
+            {
+                if (!region_contains(it->region, x0 + size / 2,
+                                     y0 + size / 2))
+                    continue;
+                inside = 1;
+            }
+        }
+        /* Children go on in reverse so that they come out in order */
+        if (tz < it->maxzoom)
+        {
+            for (i = 3; i >= 0; --i)
+            {
+                it->stack[it->depth].z = tz + 1;
+                it->stack[it->depth].x = 2 * tx + (i >> 1);
+                it->stack[it->depth].y = 2 * ty + (i & 1);
+                it->stack[it->depth].inside = inside;
+                ++it->depth;
+            }
+        }
+        if (tz >= MINZOOM)
+        {
+            *z = tz;
+            *x = tx;
+            *y = ty;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+size_t write_data(void *ptr, size_t size, size_t nmemb, struct buffer *buf)
+{
+    size_t len = size * nmemb;
+    if (buf->size + len > buf->alloc)
+    {
+        size_t alloc = buf->alloc ? buf->alloc : 16384;
+        char *data;
+        while (alloc < buf->size + len)
+            alloc *= 2;
+        if (!(data = realloc(buf->data, alloc)))
+            return 0;
+        buf->data = data;
+        buf->alloc = alloc;
+    }
+    memcpy(buf->data + buf->size, ptr, len);
+    buf->size += len;
+    return len;
+}
+
+/* FNV-1a */
+static uint64_t tile_hash(const char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < size; ++i)
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static uint64_t tile_key(int z, long x, long y)
+{
+    return 1ULL << 63 | (uint64_t)z << 48 | (uint64_t)x << 24 | (uint64_t)y;
+}
+
+static void key_tile(uint64_t key, int *z, long *x, long *y)
+{
+    /* x and y are below 2^21 at zoom 21 */
+    *z = key >> 48 & 0x1f;
+    *x = key >> 24 & 0x1fffff;
+    *y = key & 0x1fffff;
+}
+
+static struct manifest_entry *manifest_slot(struct manifest *m, uint64_t key)
+{
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20 & (m->alloc - 1);
+    while (m->entries[i].key && m->entries[i].key != key)
+        i = (i + 1) & (m->alloc - 1);
+    return &m->entries[i];
+}
+
+static struct manifest_entry *manifest_find(struct manifest *m, uint64_t key)
+{
+    struct manifest_entry *e;
+    if (!m->count)
+        return NULL;
+    e = manifest_slot(m, key);
+    return e->key ? e : NULL;
+}
+
+/* Add or replace the entry of e->key, taking its etag */
+static int manifest_put(struct manifest *m, const struct manifest_entry *e)
+{
+    struct manifest_entry *slot;
+    /* Kept at most half full */
+    if (2 * (m->count + 1) > m->alloc)
+    {
+        struct manifest m2 = {NULL, 0, m->alloc ? 2 * m->alloc : 4096, m->log,
+                              m->path};
+        size_t i;
+        if (!(m2.entries = calloc(m2.alloc, sizeof(struct manifest_entry))))
+            return 1;
+        for (i = 0; i < m->alloc; ++i)
+            if (m->entries[i].key)
+                *manifest_slot(&m2, m->entries[i].key) = m->entries[i];
+        m2.count = m->count;
+        free(m->entries);
+        *m = m2;
+    }
+    slot = manifest_slot(m, e->key);
+    if (slot->key)
+        free(slot->etag);
+    else
+        ++m->count;
+    *slot = *e;
+    return 0;
+}
+
+static int manifest_write(FILE *fp, const struct manifest_entry *e)
+{
+    int z;
+    long x, y;
+    key_tile(e->key, &z, &x, &y);
+    return fprintf(fp, "%d/%ld/%ld %ld %016llx %ld %s\n", z, x, y, e->size,
+                   (unsigned long long)e->hash, e->mtime,
+                   e->etag ? e->etag : "-");
+}
+
+/* Read the manifest if there is one and open it for appending */
+static int manifest_open(struct manifest *m)
+{
+    FILE *fp = fopen(m->path, "r");
+    char line[256];
+    if (fp)
+    {
+        while (fgets(line, sizeof(line), fp))
+        {
+            struct manifest_entry e;
+            unsigned long long hash;
+            char etag[sizeof(line)];
+            int z;
+            long x, y;
+            if (sscanf(line, "%d/%ld/%ld %ld %llx %ld %255s", &z, &x, &y,
+                       &e.size, &hash, &e.mtime, etag) != 7)
+                continue;
+            e.key = tile_key(z, x, y);
+            e.hash = hash;
+            /* Longer ones are never stored, so the line was edited */
+            e.etag = strcmp(etag, "-") == 0 || strlen(etag) >= ETAG_SIZE
+                         ? NULL
+                         : strdup(etag);
+            e.fresh = 0;
+            if (manifest_put(m, &e))
+            {
+                fclose(fp);
+                return 1;
+            }
+        }
+        fclose(fp);
+    }
+    if (!(m->log = fopen(m->path, "a")))
+        return 1;
+    return 0;
+}
+
+/* Rewrite the manifest with one line per tile */
+static int manifest_close(struct manifest *m)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    size_t i;
+    int ret = 0;
+    if (m->log)
+        fclose(m->log);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+        ret = 1;
+    for (i = 0; i < m->alloc; ++i)
+    {
+        if (!m->entries[i].key)
+            continue;
+        if (fp && manifest_write(fp, &m->entries[i]) < 0)
+            ret = 1;
+        free(m->entries[i].etag);
+    }
+    free(m->entries);
+    if (fp && (fclose(fp) != 0 || rename(tmp, m->path) != 0))
+        ret = 1;
+    return ret;
+}
+
+/* Make BASEDIR/z/x unless it was the last one made */
+static int make_dirs(int z, long x)
+{
+    static int last_z = -1;
+    static long last_x = -1;
+    char dir[sizeof(BASEDIR "/XX/XXXXXXX")];
+    if (z == last_z && x == last_x)
+        return 0;
+    sprintf(dir, BASEDIR "/%d", z);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return 1;
+    sprintf(dir, BASEDIR "/%d/%ld", z, x);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return 1;
+    last_z = z;
+    last_x = x;
+    return 0;
+}
+
+/* Write a tile under its final name only once it is complete */
+static int store_file(int z, long x, long y, const char *data, size_t size)
+{
+    char dest[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+    char part[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png.part")];
+    FILE *out;
+    if (make_dirs(z, x))
+    {
+        fprintf(stderr, "mkdir error at %d/%ld: %s\n", z, x, strerror(errno));
+        return 1;
+    }
+    sprintf(dest, BASEDIR "/%d/%ld/%ld.png", z, x, y);
+    sprintf(part, "%s.part", dest);
+    if ((out = fopen(part, "wb")) == NULL)
+    {
+        fprintf(stderr, "fopen error at %d/%ld/%ld: %s\n", z, x, y,
+                strerror(errno));
+        return 1;
+    }
+    if (fwrite(data, 1, size, out) != size || fclose(out) != 0 ||
+        rename(part, dest) != 0)
+    {
+        fprintf(stderr, "write error at %d/%ld/%ld: %s\n", z, x, y,
+                strerror(errno));
+        remove(part);
+        return 1;
+    }
+    return 0;
+}
+
+/* Store a tile as a hard link to an identical one. Returns 0 on success,
+ * 1 if a copy has to be written instead, e.g. when the link limit is hit */
+static int link_file(uint64_t same, int z, long x, long y)
+{
+    char src[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+    char dest[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+    char part[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png.part")];
+    int sz;
+    long sx, sy;
+    key_tile(same, &sz, &sx, &sy);
+    sprintf(src, BASEDIR "/%d/%ld/%ld.png", sz, sx, sy);
+    sprintf(dest, BASEDIR "/%d/%ld/%ld.png", z, x, y);
+    sprintf(part, "%s.part", dest);
+    remove(part);
+    if (make_dirs(z, x) || link(src, part) != 0)
+        return 1;
+    if (rename(part, dest) != 0)
+    {
+        remove(part);
+        return 1;
+    }
+    return 0;
+}
+
+static int archive_entry_key_cmp(const void *a, const void *b)
+{
+    const struct archive_entry *ea = a, *eb = b;
+    return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+static int archive_entry_cmp(const void *a, const void *b)
+{
+    const struct archive_entry *ea = a, *eb = b;
+    if (ea->key != eb->key)
+        return ea->key < eb->key ? -1 : 1;
+    return ea->reserved < eb->reserved ? -1 : ea->reserved > eb->reserved;
+}
+
+/* Map an archive. Returns 0 on success, 1 if it has no valid index, when
+ * a->map is still usable, and -1 if it cannot be read or is not an archive */
+static int archive_map(struct tile_archive *a, const char *path)
+{
+    struct archive_footer footer;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    a->map = NULL;
+    a->index = NULL;
+    a->count = 0;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 ||
+        st.st_size < (off_t)(sizeof(ARCHIVE_MAGIC) - 1 + 8))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    a->size = st.st_size;
+    a->map = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (a->map == MAP_FAILED)
+    {
+        a->map = NULL;
+        return -1;
+    }
+    if (memcmp(a->map, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC) - 1) != 0)
+    {
+        munmap((void *)a->map, a->size);
+        a->map = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    if (a->size < 16 + sizeof(footer))
+        return 1;
+    memcpy(&footer, a->map + a->size - sizeof(footer), sizeof(footer));
+    if (memcmp(footer.magic, ARCHIVE_INDEX_MAGIC, sizeof(footer.magic)) != 0 ||
+        footer.index < 16 || footer.index % 8 != 0 ||
+        footer.count > (a->size - sizeof(footer) - footer.index) /
+                           sizeof(struct archive_entry))
+        return 1;
+    a->index = (const struct archive_entry *)(a->map + footer.index);
+    a->count = footer.count;
+    /* Lookups binary search the index, which is read in order */
+    madvise((void *)a->map, a->size, MADV_RANDOM);
+    return 0;
+}
+
+/* The tile of key in a, without copying, or NULL */
+static const char *archive_get(const struct tile_archive *a, uint64_t key,
+                               size_t *size)
+{
+    size_t lo = 0, hi = a->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (a->index[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == a->count || a->index[lo].key != key ||
+        a->index[lo].offset + a->index[lo].size > a->size)
+        return NULL;
+    *size = a->index[lo].size;
+    return a->map + a->index[lo].offset;
+}
+
+static void archive_unmap(struct tile_archive *a)
+{
+    if (a->map)
+        munmap((void *)a->map, a->size);
+    a->map = NULL;
+}
+
+static int store_add(struct store *s, uint64_t key, uint64_t offset,
+                     uint32_t size)
+{
+    if (s->count == s->alloc)
+    {
+        size_t alloc = s->alloc ? 2 * s->alloc : 4096;
+        struct archive_entry *index =
+            realloc(s->index, sizeof(struct archive_entry) * alloc);
+        if (!index)
+            return 1;
+        s->index = index;
+        s->alloc = alloc;
+    }
+    s->index[s->count].key = key;
+    s->index[s->count].offset = offset;
+    s->index[s->count].size = size;
+    s->index[s->count].reserved = 0;
+    ++s->count;
+    return 0;
+}
+
+/* Sort the index, keeping only the last record of each tile. Entries are
+ * in the order of their records, while offsets are not: a reference points
+ * back at an earlier copy */
+static void store_sort(struct store *s)
+{
+    size_t i, n = 0;
+    for (i = 0; i < s->count; ++i)
+        s->index[i].reserved = i;
+    if (s->count)
+        qsort(s->index, s->count, sizeof(struct archive_entry),
+              archive_entry_cmp);
+    for (i = 0; i < s->count; ++i)
+    {
+        if (n && s->index[n - 1].key == s->index[i].key)
+            --n;
+        s->index[n] = s->index[i];
+        s->index[n++].reserved = 0;
+    }
+    s->count = s->sorted = n;
+}
+
+/* Open the archive at path for adding tiles, or BASEDIR if path is NULL */
+static int store_open(struct store *s, const char *path)
+{
+    struct tile_archive a;
+    int fd, ret;
+    if (!path)
+    {
+        if (mkdir(BASEDIR, 0755) != 0 && errno != EEXIST)
+            return 1;
+        return 0;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 ||
+        !(s->archive = fdopen(fd, "r+b")))
+        return 1;
+    if (lseek(fd, 0, SEEK_END) == 0)
+    {
+        uint32_t version[2] = {ARCHIVE_VERSION, 0};
+        s->end = 16;
+        if (fwrite(ARCHIVE_MAGIC, 1, 8, s->archive) != 8 ||
+            fwrite(version, sizeof(version), 1, s->archive) != 1)
+            return 1;
+        return 0;
+    }
+    if ((ret = archive_map(&a, path)) < 0)
+    {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s is not a tile archive\n", path);
+        return 1;
+    }
+    if (ret == 0)
+    {
+        /* The index is written again when the archive is closed */
+        if (a.count && !(s->index = malloc(sizeof(struct archive_entry) *
+                                           (s->alloc = a.count))))
+        {
+            archive_unmap(&a);
+            return 1;
+        }
+        memcpy(s->index, a.index, sizeof(struct archive_entry) * a.count);
+        s->count = s->sorted = a.count;
+        s->end = (const char *)a.index - a.map;
+    }
+    else
+    {
+        /* Not closed, walk the records up to the first incomplete one */
+        struct archive_record r;
+        fprintf(stderr, "Recovering the index of %s\n", path);
+        for (s->end = 16; s->end + sizeof(r) <= a.size;
+             s->end += sizeof(r) + ((r.size + 7) & ~7ULL))
+        {
+            uint64_t offset = s->end + sizeof(r);
+            memcpy(&r, a.map + s->end, sizeof(r));
+            if (r.magic == ARCHIVE_REF_MAGIC && a.size - offset >= 8)
+            {
+                memcpy(&offset, a.map + s->end + sizeof(r), 8);
+                if (offset > s->end || r.size > s->end - offset ||
+                    store_add(s, r.key, offset, r.size))
+                    break;
+                /* Walk over the offset */
+                r.size = 8;
+                continue;
             }
+            if (r.magic != ARCHIVE_RECORD_MAGIC ||
+                r.size > a.size - offset ||
+                store_add(s, r.key, offset, r.size))
+                break;
         }
+        store_sort(s);
+    }
+    archive_unmap(&a);
+    /* Drop the old index and footer before anything is appended, so that
+     * an archive left unclosed has no stale index and is recovered by
+     * walking its records */
+    if (ftruncate(fd, s->end) != 0 || fsync(fd) != 0 ||
+        fseeko(s->archive, s->end, SEEK_SET) != 0)
+        return 1;
+    return 0;
+}
+
+/* The archive entry of a tile of an earlier run */
+static struct archive_entry *store_find(struct store *s, uint64_t key)
+{
+    struct archive_entry e;
+    if (!s->sorted)
+        return NULL;
+    e.key = key;
+    return bsearch(&e, s->index, s->sorted, sizeof(struct archive_entry),
+                   archive_entry_key_cmp);
+}
+
+/* Size of the stored tile, -1 if there is none */
+static long store_size(struct store *s, int z, long x, long y)
+{
+    char dest[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+    struct stat st;
+    if (s->archive)
+    {
+        /* Only tiles of earlier runs are looked up */
+        struct archive_entry *e = store_find(s, tile_key(z, x, y));
+        return e ? (long)e->size : -1;
+    }
+    sprintf(dest, BASEDIR "/%d/%ld/%ld.png", z, x, y);
+    return stat(dest, &st) == 0 ? st.st_size : -1;
+}
+
+static struct dedup_entry *dedup_slot(struct store *s, uint64_t hash)
+{
+    size_t i = hash & (s->dedup_alloc - 1);
+    while (s->dedup[i].hash && s->dedup[i].hash != hash)
+        i = (i + 1) & (s->dedup_alloc - 1);
+    return &s->dedup[i];
+}
+
+/* Record where content of this hash is, replacing any earlier copy */
+static int dedup_put(struct store *s, uint64_t hash, uint64_t key,
+                     uint64_t offset, uint32_t size)
+{
+    struct dedup_entry *d;
+    /* 0 marks empty slots */
+    hash = hash ? hash : 1;
+    if (2 * (s->ndedup + 1) > s->dedup_alloc)
+    {
+        struct store s2;
+        size_t i;
+        s2.dedup_alloc = s->dedup_alloc ? 2 * s->dedup_alloc : 4096;
+        if (!(s2.dedup = calloc(s2.dedup_alloc, sizeof(struct dedup_entry))))
+            return 1;
+        for (i = 0; i < s->dedup_alloc; ++i)
+            if (s->dedup[i].hash)
+                *dedup_slot(&s2, s->dedup[i].hash) = s->dedup[i];
+        free(s->dedup);
+        s->dedup = s2.dedup;
+        s->dedup_alloc = s2.dedup_alloc;
     }
-    curl_easy_cleanup(curl);
-    free(URI);
-    free(DEST);
-    free(firstdir);
-    free(secdir);
+    d = dedup_slot(s, hash);
+    if (!d->hash)
+        ++s->ndedup;
+    d->hash = hash;
+    d->key = key;
+    d->offset = offset;
+    d->size = size;
     return 0;
 }
+
+/* Earlier content that has the given hash and size, or NULL */
+static struct dedup_entry *dedup_find(struct store *s, uint64_t hash,
+                                      size_t size)
+{
+    struct dedup_entry *d;
+    if (!s->ndedup)
+        return NULL;
+    d = dedup_slot(s, hash ? hash : 1);
+    return d->hash && d->size == size ? d : NULL;
+}
+
+/* Whether the copy d really has this content, hashes can collide */
+static int dedup_same(struct store *s, const struct dedup_entry *d,
+                      const char *data, size_t size)
+{
+    char *copy = malloc(size ? size : 1);
+    int same = 0;
+    if (!copy)
+        return 0;
+    if (s->archive)
+    {
+        /* It may still be buffered */
+        same = fflush(s->archive) == 0 &&
+               pread(fileno(s->archive), copy, size, d->offset) ==
+                   (ssize_t)size;
+    }
+    else
+    {
+        char src[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+        FILE *fp;
+        int z;
+        long x, y;
+        key_tile(d->key, &z, &x, &y);
+        sprintf(src, BASEDIR "/%d/%ld/%ld.png", z, x, y);
+        if ((fp = fopen(src, "rb")))
+        {
+            same = fread(copy, 1, size, fp) == size && getc(fp) == EOF;
+            fclose(fp);
+        }
+    }
+    same = same && memcmp(copy, data, size) == 0;
+    free(copy);
+    return same;
+}
+
+/* Learn the content of the tiles of earlier runs from the manifest */
+static int store_seed(struct store *s, const struct manifest *m)
+{
+    size_t i;
+    for (i = 0; i < m->alloc; ++i)
+    {
+        const struct manifest_entry *e = &m->entries[i];
+        uint64_t offset = 0;
+        if (!e->key)
+            continue;
+        if (s->archive)
+        {
+            struct archive_entry *a = store_find(s, e->key);
+            if (!a || a->size != e->size)
+                continue;
+            offset = a->offset;
+        }
+        if (!dedup_find(s, e->hash, e->size) &&
+            dedup_put(s, e->hash, e->key, offset, e->size))
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether the tile of key is already stored as the copy d */
+static int store_shares(struct store *s, uint64_t key,
+                        const struct dedup_entry *d)
+{
+    char path[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+    struct stat st1, st2;
+    int z;
+    long x, y;
+    if (s->archive)
+    {
+        struct archive_entry *e = store_find(s, key);
+        return e && e->offset == d->offset;
+    }
+    key_tile(key, &z, &x, &y);
+    sprintf(path, BASEDIR "/%d/%ld/%ld.png", z, x, y);
+    if (stat(path, &st1) != 0)
+        return 0;
+    key_tile(d->key, &z, &x, &y);
+    sprintf(path, BASEDIR "/%d/%ld/%ld.png", z, x, y);
+    return stat(path, &st2) == 0 && st1.st_dev == st2.st_dev &&
+           st1.st_ino == st2.st_ino;
+}
+
+/* Store a tile whose content hashes to hash */
+static int store_put(struct store *s, int z, long x, long y, const char *data,
+                     size_t size, uint64_t hash)
+{
+    static const char padding[8];
+    size_t pad = -size & 7;
+    struct archive_record r;
+    struct dedup_entry *d = dedup_find(s, hash, size);
+    uint64_t offset = 0;
+    r.key = tile_key(z, x, y);
+    if (d && dedup_same(s, d, data, size))
+    {
+        /* Sent again unchanged */
+        if (d->key == r.key || store_shares(s, r.key, d))
+            return 0;
+        if (!s->archive && link_file(d->key, z, x, y) == 0)
+        {
+            ++s->duplicates;
+            s->saved += size;
+            return 0;
+        }
+        if (s->archive)
+        {
+            r.size = size;
+            r.magic = ARCHIVE_REF_MAGIC;
+            if (fwrite(&r, sizeof(r), 1, s->archive) != 1 ||
+                fwrite(&d->offset, 8, 1, s->archive) != 1 ||
+                store_add(s, r.key, d->offset, size))
+                goto error;
+            s->end += sizeof(r) + 8;
+            ++s->duplicates;
+            s->saved += size;
+            return 0;
+        }
+    }
+    if (!s->archive)
+    {
+        if (store_file(z, x, y, data, size))
+            return 1;
+    }
+    else
+    {
+        r.size = size;
+        r.magic = ARCHIVE_RECORD_MAGIC;
+        if (fwrite(&r, sizeof(r), 1, s->archive) != 1 ||
+            fwrite(data, 1, size, s->archive) != size ||
+            fwrite(padding, 1, pad, s->archive) != pad ||
+            store_add(s, r.key, offset = s->end + sizeof(r), size))
+            goto error;
+        s->end += sizeof(r) + size + pad;
+    }
+    /* Later copies refer to this one */
+    return dedup_put(s, hash, r.key, offset, size);
+
+error:
+    fprintf(stderr, "archive error at %d/%ld/%ld: %s\n", z, x, y,
+            strerror(errno));
+    return 1;
+}
+
+/* Write the index of the archive */
+static int store_close(struct store *s)
+{
+    struct archive_footer footer;
+    int ret = 0;
+    free(s->dedup);
+    if (!s->archive)
+        return 0;
+    store_sort(s);
+    footer.index = s->end;
+    footer.count = s->count;
+    memcpy(footer.magic, ARCHIVE_INDEX_MAGIC, sizeof(footer.magic));
+    if (fwrite(s->index, sizeof(struct archive_entry), s->count, s->archive) !=
+            s->count ||
+        fwrite(&footer, sizeof(footer), 1, s->archive) != 1 ||
+        fflush(s->archive) != 0 ||
+        ftruncate(fileno(s->archive),
+                  s->end + sizeof(struct archive_entry) * s->count +
+                      sizeof(footer)) != 0)
+        ret = 1;
+    free(s->index);
+    if (fclose(s->archive) != 0)
+        ret = 1;
+    return ret;
+}
+
+static size_t read_header(char *line, size_t size, size_t nitems,
+                          struct transfer *t)
+{
+    size_t len = size * nitems, i = 5, n = 0;
+    if (len > 5 && strncasecmp(line, "ETag:", 5) == 0)
+    {
+        while (i < len && (line[i] == ' ' || line[i] == '\t'))
+            ++i;
+        while (i < len && n < sizeof(t->etag) - 1 && line[i] != '\r' &&
+               line[i] != '\n')
+            t->etag[n++] = line[i++];
+        t->etag[n] = 0;
+        /* Spaces would break the manifest, and a cut one never matches */
+        if (strchr(t->etag, ' ') ||
+            (i < len && line[i] != '\r' && line[i] != '\n'))
+            t->etag[0] = 0;
+    }
+    return len;
+}
+
+/* Whether the tile has to be requested. refresh asks the server whether
+ * known tiles have changed, otherwise tiles already there are skipped */
+static int want_tile(struct store *s, struct manifest *m, int z, long x,
+                     long y, int refresh)
+{
+    struct manifest_entry *e = manifest_find(m, tile_key(z, x, y));
+    long size = store_size(s, z, x, y);
+    /* Tiles without an entry were left by a run without the manifest */
+    if (size >= 0 && (!e || e->size == size))
+        return refresh;
+    /* Missing or damaged, ask for it unconditionally */
+    if (e)
+    {
+        e->mtime = -1;
+        free(e->etag);
+        e->etag = NULL;
+    }
+    return 1;
+}
+
+/* Monotonic time in seconds */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void limiter_init(struct limiter *l, int max, double rate)
+{
+    l->max = max;
+    l->limit = max < 4 ? max : 4;
+    l->slow_start = 1;
+    l->since_cut = LONG_MAX;
+    l->latency = l->best = 0;
+    l->rate = rate;
+    /* Up to a second of requests at once */
+    l->tokens = rate > 1 ? rate : 1;
+    l->refilled = l->paused_until = now();
+}
+
+/* Seconds until the next request may go, 0 if it may go now */
+static double limiter_delay(struct limiter *l, double t)
+{
+    double burst = l->rate > 1 ? l->rate : 1;
+    if (t < l->paused_until)
+        return l->paused_until - t;
+    if (!l->rate)
+        return 0;
+    l->tokens += (t - l->refilled) * l->rate;
+    l->refilled = t;
+    if (l->tokens > burst)
+        l->tokens = burst;
+    return l->tokens >= 1 ? 0 : (1 - l->tokens) / l->rate;
+}
+
+static void limiter_take(struct limiter *l)
+{
+    if (l->rate)
+        --l->tokens;
+}
+
+/* Multiplicative decrease, once per window */
+static void limiter_cut(struct limiter *l, double factor)
+{
+    l->slow_start = 0;
+    if (l->since_cut < l->limit)
+        return;
+    l->limit *= factor;
+    if (l->limit < 1)
+        l->limit = 1;
+    l->since_cut = 0;
+}
+
+/* The server answered in latency seconds */
+static void limiter_success(struct limiter *l, double latency)
+{
+    if (l->since_cut < LONG_MAX)
+        ++l->since_cut;
+    l->latency = l->latency ? 0.875 * l->latency + 0.125 * latency : latency;
+    if (!l->best || latency < l->best)
+        l->best = latency;
+    /* Requests are queueing on the server. The slack keeps fast servers
+     * from being held back by jitter */
+    if (l->latency > 2 * l->best + 0.1)
+    {
+        limiter_cut(l, 0.8);
+        return;
+    }
+    l->limit += l->slow_start ? 1 : 1 / l->limit;
+    if (l->limit > l->max)
+        l->limit = l->max;
+}
+
+/* The server is overloaded and asks for pause seconds of quiet, 0 if it
+ * did not say */
+static void limiter_overload(struct limiter *l, double pause)
+{
+    if (l->since_cut < LONG_MAX)
+        ++l->since_cut;
+    limiter_cut(l, 0.5);
+    if (pause > 0 && now() + pause > l->paused_until)
+        l->paused_until = now() + pause;
+}
+
+/* Exponential backoff with full jitter, at least what the server asked */
+static double backoff(int attempt, double pause)
+{
+    double delay = 0.5 * (1 << attempt);
+    delay = (delay < 60 ? delay : 60) * rand() / RAND_MAX;
+    return delay > pause ? delay : pause;
+}
+
+static int retry_push(struct retry_queue *q, const struct transfer *t)
+{
+    struct retry *r;
+    if (q->count == q->alloc)
+    {
+        size_t alloc = q->alloc ? 2 * q->alloc : 64;
+        struct retry *items = realloc(q->items, sizeof(struct retry) * alloc);
+        if (!items)
+            return 1;
+        q->items = items;
+        q->alloc = alloc;
+    }
+    r = &q->items[q->count++];
+    r->z = t->z;
+    r->x = t->x;
+    r->y = t->y;
+    r->attempt = t->attempt + 1;
+    r->due = now() + t->delay;
+    return 0;
+}
+
+/* The retry due first, or NULL if there is none */
+static struct retry *retry_next(struct retry_queue *q)
+{
+    struct retry *next = NULL;
+    size_t i;
+    for (i = 0; i < q->count; ++i)
+        if (!next || q->items[i].due < next->due)
+            next = &q->items[i];
+    return next;
+}
+
+/* Take the retry due first if its time has come */
+static int retry_pop(struct retry_queue *q, double t, struct retry *r)
+{
+    struct retry *next = retry_next(q);
+    if (!next || next->due > t)
+        return 0;
+    *r = *next;
+    *next = q->items[--q->count];
+    return 1;
+}
+
+/* Errors that may go away on their own */
+static int transient(CURLcode res)
+{
+    switch (res)
+    {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_HTTP2:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_HTTP2_STREAM:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void start_tile(CURLM *multi, struct manifest *m, struct transfer *t,
+                       int z, long x, long y, int attempt)
+{
+    struct manifest_entry *e = manifest_find(m, tile_key(z, x, y));
+    t->z = z;
+    t->x = x;
+    t->y = y;
+    t->attempt = attempt;
+    t->body.size = 0;
+    t->etag[0] = 0;
+    sprintf(t->url, URLBASE "/%d/%ld/%ld.png" URLARGS, z, x, y);
+    curl_easy_setopt(t->curl, CURLOPT_URL, t->url);
+    /* Only changed tiles are sent again */
+    curl_slist_free_all(t->headers);
+    t->headers = NULL;
+    if (e && e->etag)
+    {
+        char header[sizeof("If-None-Match: ") + sizeof(t->etag)];
+        snprintf(header, sizeof(header), "If-None-Match: %s", e->etag);
+        t->headers = curl_slist_append(NULL, header);
+    }
+    curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+    /* Servers go by the ETag when there is one. libcurl would drop a 200
+     * whose Last-Modified is not newer, even if the ETag changed */
+    if (e && !e->etag && e->mtime >= 0)
+    {
+        curl_easy_setopt(t->curl, CURLOPT_TIMECONDITION,
+                         (long)CURL_TIMECOND_IFMODSINCE);
+        curl_easy_setopt(t->curl, CURLOPT_TIMEVALUE, e->mtime);
+    }
+    else
+        curl_easy_setopt(t->curl, CURLOPT_TIMECONDITION,
+                         (long)CURL_TIMECOND_NONE);
+    curl_multi_add_handle(multi, t->curl);
+}
+
+/* Store a tile and note it in the manifest. etag is taken */
+static int keep_tile(struct store *s, struct manifest *m, int z, long x,
+                     long y, const char *data, size_t size, long mtime,
+                     char *etag)
+{
+    struct manifest_entry e;
+    e.hash = tile_hash(data, size);
+    if (store_put(s, z, x, y, data, size, e.hash))
+    {
+        free(etag);
+        return 1;
+    }
+    e.key = tile_key(z, x, y);
+    e.size = size;
+    e.mtime = mtime;
+    e.etag = etag;
+    e.fresh = 1;
+    if (manifest_put(m, &e) || manifest_write(m->log, &e) < 0 ||
+        fflush(m->log) != 0)
+    {
+        fprintf(stderr, "manifest error at %d/%ld/%ld\n", z, x, y);
+        return 1;
+    }
+    printf("%d/%ld/%ld\n", z, x, y);
+    return 0;
+}
+
+/* Returns 0 if the tile was stored or has not changed, 1 if it failed, 2 if
+ * it is to be tried again after t->delay */
+static int finish_tile(struct store *s, struct manifest *m, struct limiter *l,
+                       struct transfer *t, CURLcode res, long *unchanged)
+{
+    long code = 0, mtime = -1;
+    double latency = 0;
+    if (res != CURLE_OK)
+    {
+        if (transient(res))
+            limiter_overload(l, 0);
+        fprintf(stderr, "curl error at %d/%ld/%ld: %s", t->z, t->x, t->y,
+                curl_easy_strerror(res));
+        if (transient(res) && t->attempt < RETRIES)
+        {
+            t->delay = backoff(t->attempt, 0);
+            fprintf(stderr, ", retrying in %.1f s\n", t->delay);
+            return 2;
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code == 429 || code >= 500)
+    {
+        curl_off_t pause = 0;
+        curl_easy_getinfo(t->curl, CURLINFO_RETRY_AFTER, &pause);
+        limiter_overload(l, pause);
+        fprintf(stderr, "HTTP %ld at %d/%ld/%ld", code, t->z, t->x, t->y);
+        if (t->attempt < RETRIES)
+        {
+            t->delay = backoff(t->attempt, pause);
+            fprintf(stderr, ", retrying in %.1f s\n", t->delay);
+            return 2;
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    curl_easy_getinfo(t->curl, CURLINFO_TOTAL_TIME, &latency);
+    limiter_success(l, latency);
+    if (code == 304)
+    {
+        ++*unchanged;
+        return 0;
+    }
+    if (code != 200)
+    {
+        fprintf(stderr, "HTTP %ld at %d/%ld/%ld\n", code, t->z, t->x, t->y);
+        return 1;
+    }
+    curl_easy_getinfo(t->curl, CURLINFO_FILETIME, &mtime);
+    return keep_tile(s, m, t->z, t->x, t->y, t->body.data, t->body.size, mtime,
+                     t->etag[0] ? strdup(t->etag) : NULL);
+}
+
+/* How much deduplication saved in this run and overall */
+static void print_savings(const struct store *s, const struct manifest *m)
+{
+    unsigned long long total = 0, unique = 0;
+    size_t i;
+    for (i = 0; i < m->alloc; ++i)
+        total += m->entries[i].key ? m->entries[i].size : 0;
+    for (i = 0; i < s->dedup_alloc; ++i)
+        unique += s->dedup[i].hash ? s->dedup[i].size : 0;
+    fprintf(stderr,
+            "%ld duplicates stored once, %.1f MiB saved; "
+            "%.1f MiB of tiles in %.1f MiB\n",
+            s->duplicates, s->saved / 1048576.0, total / 1048576.0,
+            unique / 1048576.0);
+}
+
+/* Read child i of a job */
+static char *synth_load(int fd, const struct synth_job *job, int i)
+{
+    size_t size = job->size[i];
+    char *data = malloc(size ? size : 1);
+    int ok = 0;
+    if (!data)
+        return NULL;
+    if (fd >= 0)
+        ok = pread(fd, data, size, job->offset[i]) == (ssize_t)size;
+    else
+    {
+        char path[sizeof(BASEDIR "/XX/XXXXXXX/XXXXXXX.png")];
+        FILE *fp;
+        sprintf(path, BASEDIR "/%d/%ld/%ld.png", job->z + 1,
+                2 * job->x + (i >> 1), 2 * job->y + (i & 1));
+        if ((fp = fopen(path, "rb")))
+        {
+            ok = fread(data, 1, size, fp) == size;
+            fclose(fp);
+        }
+    }
+    if (!ok)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/* Colors are averaged premultiplied by alpha, or transparent pixels would
+ * darken their neighbours */
+static void premultiply(unsigned char *p, size_t n)
+{
+    for (; n--; p += 4)
+    {
+        p[0] = (p[0] * p[3] + 127) / 255;
+        p[1] = (p[1] * p[3] + 127) / 255;
+        p[2] = (p[2] * p[3] + 127) / 255;
+    }
+}
+
+static void unpremultiply(unsigned char *p, size_t n)
+{
+    int c;
+    for (; n--; p += 4)
+        if (p[3] && p[3] != 255)
+            for (c = 0; c < 3; ++c)
+            {
+                int v = (p[c] * 255 + p[3] / 2) / p[3];
+                p[c] = v > 255 ? 255 : v;
+            }
+}
+
+/* Halve a w x h RGBA image into dst, whose rows are stride bytes apart, by
+ * averaging each 2x2 block */
+static void downsample(const unsigned char *src, size_t w, size_t h,
+                       unsigned char *dst, size_t stride)
+{
+    size_t ox, oy;
+    for (oy = 0; oy < h / 2; ++oy)
+    {
+        const unsigned char *a = src + 2 * oy * w * 4, *b = a + w * 4;
+        unsigned char *d = dst + oy * stride;
+        ox = 0;
+#ifdef __SSE2__
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i two = _mm_set1_epi16(2);
+            /* 8 pixels of two rows, widened to 16 bits, make 4 */
+            for (; ox + 4 <= w / 2; ox += 4)
+            {
+                __m128i a0 = _mm_loadu_si128((const __m128i *)(a + 8 * ox));
+                __m128i a1 =
+                    _mm_loadu_si128((const __m128i *)(a + 8 * ox + 16));
+                __m128i b0 = _mm_loadu_si128((const __m128i *)(b + 8 * ox));
+                __m128i b1 =
+                    _mm_loadu_si128((const __m128i *)(b + 8 * ox + 16));
+                /* Columns: pixels 0 1, 2 3, 4 5, 6 7 */
+                __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                                           _mm_unpacklo_epi8(b0, zero));
+                __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                                           _mm_unpackhi_epi8(b0, zero));
+                __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                                           _mm_unpacklo_epi8(b1, zero));
+                __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                                           _mm_unpackhi_epi8(b1, zero));
+                /* Then even plus odd columns */
+                __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+                                           _mm_unpackhi_epi64(s0, s1));
+                __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+                                           _mm_unpackhi_epi64(s2, s3));
+                lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+                hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+                _mm_storeu_si128((__m128i *)(d + 4 * ox),
+                                 _mm_packus_epi16(lo, hi));
+            }
+        }
+#endif
+        for (; ox < w / 2; ++ox)
+        {
+            int c;
+            for (c = 0; c < 4; ++c)
+                d[4 * ox + c] = (a[8 * ox + c] + a[8 * ox + 4 + c] +
+                                 b[8 * ox + c] + b[8 * ox + 4 + c] + 2) >>
+                                2;
+        }
+    }
+}
+
+/* Make the PNG of a job from its children. Missing children leave their
+ * quarter transparent */
+static void synth_tile(int fd, struct synth_job *job)
+{
+    unsigned char *rgba = NULL, *out = NULL;
+    char *data = NULL;
+    png_image img;
+    size_t w = 0, h = 0, size, i;
+    int child, opaque = 1;
+    for (child = 0; child < 4; ++child)
+    {
+        if (job->size[child] < 0)
+        {
+            opaque = 0;
+            continue;
+        }
+        memset(&img, 0, sizeof(img));
+        img.version = PNG_IMAGE_VERSION;
+        if (!(data = synth_load(fd, job, child)))
+        {
+            fprintf(stderr, "read error at %d/%ld/%ld\n", job->z + 1,
+                    2 * job->x + (child >> 1), 2 * job->y + (child & 1));
+            goto error;
+        }
+        if (!png_image_begin_read_from_memory(&img, data, job->size[child]))
+            goto png_error;
+        if (!out)
+        {
+            w = img.width;
+            h = img.height;
+            if (w % 2 || h % 2 || w > 4096 || h > 4096)
+            {
+                fprintf(stderr, "%zux%zu tiles cannot be halved\n", w, h);
+                goto error;
+            }
+            if (!(out = calloc(w * h, 4)) || !(rgba = malloc(w * h * 4)))
+            {
+                fprintf(stderr, "Malloc failed\n");
+                goto error;
+            }
+        }
+        if (img.width != w || img.height != h)
+        {
+            fprintf(stderr, "Tiles of different sizes under %d/%ld/%ld\n",
+                    job->z, job->x, job->y);
+            goto error;
+        }
+        if (img.format & PNG_FORMAT_FLAG_ALPHA)
+            opaque = 0;
+        img.format = PNG_FORMAT_RGBA;
+        if (!png_image_finish_read(&img, NULL, rgba, 0, NULL))
+            goto png_error;
+        free(data);
+        data = NULL;
+        /* Opaque pixels are their own premultiplied values */
+        if (!opaque)
+            premultiply(rgba, w * h);
+        downsample(rgba, w, h,
+                   out + (child & 1) * (h / 2) * w * 4 + (child >> 1) * w * 2,
+                   w * 4);
+    }
+    memset(&img, 0, sizeof(img));
+    img.version = PNG_IMAGE_VERSION;
+    img.width = w;
+    img.height = h;
+    if (opaque)
+    {
+        /* Smaller without alpha */
+        for (i = 0; i < w * h; ++i)
+            memmove(out + 3 * i, out + 4 * i, 3);
+        img.format = PNG_FORMAT_RGB;
+    }
+    else
+    {
+        unpremultiply(out, w * h);
+        img.format = PNG_FORMAT_RGBA;
+    }
+    if (!png_image_write_to_memory(&img, NULL, &size, 0, out, 0, NULL))
+        goto png_error;
+    if (!(job->png = malloc(size)))
+    {
+        fprintf(stderr, "Malloc failed\n");
+        goto error;
+    }
+    if (!png_image_write_to_memory(&img, job->png, &size, 0, out, 0, NULL))
+    {
+        free(job->png);
+        job->png = NULL;
+        goto png_error;
+    }
+    job->png_size = size;
+    free(rgba);
+    free(out);
+    return;
+
+png_error:
+    fprintf(stderr, "PNG error under %d/%ld/%ld: %s\n", job->z, job->x,
+            job->y, img.message);
+error:
+    png_image_free(&img);
+    free(data);
+    free(rgba);
+    free(out);
+}
+
+static void *synth_worker(void *arg)
+{
+    struct synth *syn = arg;
+    size_t idx;
+    while ((idx = atomic_fetch_add(&syn->next, 1)) < syn->count)
+        synth_tile(syn->fd, &syn->jobs[idx]);
+    return NULL;
+}
+
+/* Whether tile z/x/y has to be made again: it is missing, or one of its
+ * children was stored by this run. Fills in job */
+static int synth_wanted(struct store *s, struct manifest *m,
+                        struct synth_job *job, int z, long x, long y)
+{
+    int i, children = 0, fresh = 0;
+    job->z = z;
+    job->x = x;
+    job->y = y;
+    job->png = NULL;
+    for (i = 0; i < 4; ++i)
+    {
+        long cx = 2 * x + (i >> 1), cy = 2 * y + (i & 1);
+        struct manifest_entry *e = manifest_find(m, tile_key(z + 1, cx, cy));
+        job->offset[i] = 0;
+        if (s->archive)
+        {
+            struct archive_entry *a = store_find(s, tile_key(z + 1, cx, cy));
+            job->size[i] = a ? (long)a->size : -1;
+            job->offset[i] = a ? a->offset : 0;
+        }
+        else
+            job->size[i] = store_size(s, z + 1, cx, cy);
+        if (job->size[i] < 0)
+            continue;
+        ++children;
+        fresh |= e && e->fresh;
+    }
+    return children && (fresh || store_size(s, z, x, y) < 0);
+}
+
+/* Make the tiles below zoom from out of those of zoom, each level from the
+ * one above so that it is complete first. The tiles of a batch are made in
+ * parallel, then stored in order. Returns the number that failed */
+static long synthesize(struct store *s, struct manifest *m,
+                       const struct region *region, int zoom, long *made)
+{
+    struct synth syn;
+    struct tile_iter it;
+    pthread_t *workers;
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN), started, failed = 0, i;
+    int z, tz, more = 0;
+    long tx, ty;
+    if (nworkers < 1)
+        nworkers = 1;
+    syn.fd = s->archive ? fileno(s->archive) : -1;
+    syn.jobs = malloc(sizeof(struct synth_job) * SYNTH_BATCH);
+    workers = malloc(sizeof(pthread_t) * nworkers);
+    if (!syn.jobs || !workers)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(syn.jobs);
+        free(workers);
+        return 1;
+    }
+    for (z = zoom - 1; z >= MINZOOM; --z)
+    {
+        /* The level above is read back, including what this run added */
+        if (s->archive)
+        {
+            if (fflush(s->archive) != 0)
+            {
+                fprintf(stderr, "archive error: %s\n", strerror(errno));
+                ++failed;
+                break;
+            }
+            store_sort(s);
+        }
+        if (tile_iter_init(&it, region, z))
+        {
+            fprintf(stderr, "Malloc failed\n");
+            tile_iter_free(&it);
+            ++failed;
+            break;
+        }
+        do
+        {
+            syn.count = 0;
+            while (syn.count < SYNTH_BATCH &&
+                   (more = next_tile(&it, &tz, &tx, &ty)))
+                if (tz == z &&
+                    synth_wanted(s, m, &syn.jobs[syn.count], z, tx, ty))
+                    ++syn.count;
+            atomic_init(&syn.next, 0);
+            for (started = 0; started < nworkers && (size_t)started < syn.count;
+                 ++started)
+                if (pthread_create(&workers[started], NULL, synth_worker,
+                                   &syn) != 0)
+                    break;
+            if (started == 0)
+                synth_worker(&syn);
+            for (i = 0; i < started; ++i)
+                pthread_join(workers[i], NULL);
+            for (i = 0; (size_t)i < syn.count; ++i)
+            {
+                struct synth_job *job = &syn.jobs[i];
+                if (!job->png ||
+                    keep_tile(s, m, job->z, job->x, job->y, (char *)job->png,
+                              job->png_size, -1, NULL))
+                    ++failed;
+                else
+                    ++*made;
+                free(job->png);
+            }
+        } while (more);
+        tile_iter_free(&it);
+    }
+    free(syn.jobs);
+    free(workers);
+    return failed;
+}
+
+/* Write a tile of an archive to stdout */
+static int extract_tile(const char *path, const char *tile)
+{
+    struct tile_archive a;
+    const char *data;
+    size_t size;
+    int z;
+    long x, y;
+    if (sscanf(tile, "%d/%ld/%ld", &z, &x, &y) != 3)
+    {
+        fprintf(stderr, "-g: expected Z/X/Y\n");
+        return 1;
+    }
+    if (archive_map(&a, path) != 0)
+    {
+        fprintf(stderr, "Cannot read the index of %s\n", path);
+        archive_unmap(&a);
+        return 1;
+    }
+    if (!(data = archive_get(&a, tile_key(z, x, y), &size)))
+    {
+        fprintf(stderr, "%s: no tile %s\n", path, tile);
+        archive_unmap(&a);
+        return 1;
+    }
+    fwrite(data, 1, size, stdout);
+    archive_unmap(&a);
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-nr] [-c COUNT] [-q RATE] [-s ZOOM] [-a ARCHIVE]\n"
+           "       %*s [-b BBOX | -p GEOJSON]\n"
+           "       %s -a ARCHIVE -g Z/X/Y\n"
+           "Download zoom levels %d to %d of " URLBASE " into " BASEDIR ".\n"
+           "Tiles already there are skipped, so an interrupted run can be\n"
+           "resumed by running again.\n\n"
+           "  -b BBOX     only the tiles touching BBOX, given in degrees as\n"
+           "              WEST,SOUTH,EAST,NORTH\n"
+           "  -p GEOJSON  only the tiles touching the polygons of GEOJSON\n"
+           "  -n          list the tiles instead of downloading them\n"
+           "  -a ARCHIVE  keep the tiles in the single file ARCHIVE instead\n"
+           "  -g Z/X/Y    write tile Z/X/Y of ARCHIVE to stdout\n"
+           "  -c COUNT    keep up to COUNT tiles in flight, fewer while the\n"
+           "              server seems overloaded [%d]\n"
+           "  -q RATE     send at most RATE requests per second\n"
+           "  -s ZOOM     make the tiles below ZOOM from those of ZOOM instead\n"
+           "              of downloading them\n"
+           "  -r          refresh: download the tiles already there again if\n"
+           "              they have changed on the server\n"
+           "  -h          display this help and exit\n",
+           argv0, (int)strlen(argv0), "", argv0, MINZOOM, MAXZOOM, MAXCONN);
+}
+
+int main(int argc, char **argv)
+{
+    struct tile_iter it;
+    struct region region = {NULL, 0, 0};
+    struct limiter limiter;
+    struct retry_queue retries = {NULL, 0, 0};
+    struct transfer *transfers = NULL, **idle = NULL;
+    struct manifest manifest = {NULL, 0, 0, NULL, NULL};
+    struct store store = {NULL, NULL, 0, 0, 0, 0, NULL, 0, 0, 0, 0};
+    const char *archive = NULL, *get = NULL;
+    int maxconn = MAXCONN, refresh = 0, list = 0, synth = 0, nidle = 0,
+        inflight = 0, more = 1, opt, z, i, ret = 1;
+    long x, y;
+    long done = 0, failed = 0, skipped = 0, unchanged = 0, retried = 0,
+         made = 0;
+    double rate = 0;
+    struct timespec start, end;
+    CURLM *multi = NULL;
+
+    while ((opt = getopt(argc, argv, "a:b:g:c:np:q:rs:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                archive = optarg;
+                break;
+            case 'b':
+                if (region.count || region_bbox(&region, optarg))
+                {
+                    fprintf(stderr, "-b: expected one WEST,SOUTH,EAST,NORTH\n");
+                    free(region.edges);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (region.count || region_geojson(&region, optarg))
+                {
+                    fprintf(stderr, "-p: no polygon read from %s\n", optarg);
+                    free(region.edges);
+                    return 1;
+                }
+                break;
+            case 'n':
+                list = 1;
+                break;
+            case 'g':
+                get = optarg;
+                break;
+            case 'c':
+                maxconn = atoi(optarg);
+                if (maxconn < 1)
+                {
+                    fprintf(stderr, "-c: must be positive\n");
+                    return 1;
+                }
+                break;
+            case 'q':
+                rate = atof(optarg);
+                if (rate <= 0)
+                {
+                    fprintf(stderr, "-q: must be positive\n");
+                    free(region.edges);
+                    return 1;
+                }
+                break;
+            case 'r':
+                refresh = 1;
+                break;
+            case 's':
+                synth = atoi(optarg);
+                if (synth <= MINZOOM || synth > MAXZOOM)
+                {
+                    fprintf(stderr, "-s: expected a zoom from %d to %d\n",
+                            MINZOOM + 1, MAXZOOM);
+                    free(region.edges);
+                    return 1;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (get)
+    {
+        free(region.edges);
+        if (archive)
+            return extract_tile(archive, get);
+        fprintf(stderr, "-g: -a expected\n");
+        return 1;
+    }
+    if (tile_iter_init(&it, region.count ? &region : NULL, MAXZOOM))
+    {
+        fprintf(stderr, "Malloc failed\n");
+        goto cleanup;
+    }
+    if (list)
+    {
+        long count = 0;
+        while (next_tile(&it, &z, &x, &y))
+        {
+            printf("%d/%ld/%ld\n", z, x, y);
+            ++count;
+        }
+        fprintf(stderr, "%ld tiles\n", count);
+        ret = 0;
+        goto cleanup;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    /* Jitter of the retries */
+    srand(time(NULL) ^ getpid());
+    transfers = calloc(maxconn, sizeof(struct transfer));
+    idle = malloc(sizeof(struct transfer *) * maxconn);
+    if (!transfers || !idle || !(multi = curl_multi_init()))
+    {
+        fprintf(stderr, "Curl init error\n");
+        goto cleanup;
+    }
+    /* Many tiles over one connection where the server speaks HTTP/2 */
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    for (i = 0; i < maxconn; ++i)
+    {
+        struct transfer *t = &transfers[i];
+        if (!(t->curl = curl_easy_init()))
+        {
+            fprintf(stderr, "Curl init error\n");
+            goto cleanup;
+        }
+        curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, write_data);
+        curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->body);
+        curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, read_header);
+        curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t);
+        curl_easy_setopt(t->curl, CURLOPT_FILETIME, 1L);
+        curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t);
+        curl_easy_setopt(t->curl, CURLOPT_USERAGENT, USRAGNT);
+        curl_easy_setopt(t->curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+        /* Wait for a connection that can multiplex rather than open more */
+        curl_easy_setopt(t->curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+        /* A stalled transfer is an error to retry rather than a hang */
+        curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT, 30L);
+        curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_TIME, 30L);
+        idle[nidle++] = t;
+    }
+    if (store_open(&store, archive))
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", archive ? archive : BASEDIR,
+                strerror(errno));
+        goto cleanup;
+    }
+    if (archive)
+    {
+        if ((manifest.path = malloc(strlen(archive) + sizeof("." MANIFEST))))
+            sprintf(manifest.path, "%s." MANIFEST, archive);
+    }
+    else
+        manifest.path = strdup(BASEDIR "/" MANIFEST);
+    if (!manifest.path || manifest_open(&manifest))
+    {
+        fprintf(stderr, "Cannot open %s: %s\n",
+                manifest.path ? manifest.path : MANIFEST, strerror(errno));
+        goto cleanup;
+    }
+    if (store_seed(&store, &manifest))
+    {
+        fprintf(stderr, "Malloc failed\n");
+        goto cleanup;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    limiter_init(&limiter, maxconn, rate);
+    for (;;)
+    {
+        CURLMsg *msg;
+        struct retry r, *next;
+        int running, left, finished = 0;
+        double t = now(), wait;
+        while (nidle && inflight < (int)limiter.limit &&
+               limiter_delay(&limiter, t) == 0)
+        {
+            /* Tiles to try again come first */
+            if (retry_pop(&retries, t, &r))
+                start_tile(multi, &manifest, idle[--nidle], r.z, r.x, r.y,
+                           r.attempt);
+            else
+            {
+                /* Lower zooms made afterwards are not fetched */
+                while ((more = next_tile(&it, &z, &x, &y)) &&
+                       (z < synth ||
+                        !want_tile(&store, &manifest, z, x, y, refresh)))
+                    skipped += z >= synth;
+                if (!more)
+                    break;
+                start_tile(multi, &manifest, idle[--nidle], z, x, y, 0);
+            }
+            limiter_take(&limiter);
+            ++inflight;
+        }
+        if (!inflight && !retries.count && !more)
+            break;
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &left)))
+        {
+            struct transfer *tr;
+            int status;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                              (char **)&tr);
+            status = finish_tile(&store, &manifest, &limiter, tr,
+                                 msg->data.result, &unchanged);
+            if (status == 2 && retry_push(&retries, tr))
+            {
+                fprintf(stderr, "Malloc failed\n");
+                status = 1;
+            }
+            failed += status == 1;
+            retried += status == 2;
+            done += status != 2;
+            curl_multi_remove_handle(multi, tr->curl);
+            idle[nidle++] = tr;
+            --inflight;
+            ++finished;
+        }
+        /* Refill at once if anything finished, otherwise sleep until a
+         * transfer progresses or the next tile may start */
+        if (finished)
+            continue;
+        t = now();
+        wait = 1;
+        if (nidle && inflight < (int)limiter.limit)
+        {
+            /* Until there is a tile to start and the limiter lets it go */
+            if (!more && (next = retry_next(&retries)))
+                wait = next->due - t;
+            if (limiter_delay(&limiter, t) > wait || more)
+                wait = limiter_delay(&limiter, t);
+            wait = wait > 1 ? 1 : wait < 0 ? 0 : wait;
+        }
+        if (inflight)
+            curl_multi_wait(multi, NULL, 0, wait * 1000 + 1, NULL);
+        else if (wait > 0)
+            usleep(wait < 1 ? wait * 1e6 : 999999);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    {
+        double secs = (end.tv_sec - start.tv_sec) +
+                      (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr,
+                "%ld tiles, %ld failed, %ld unchanged, %ld skipped, "
+                "%ld retries, %.1f tiles/s, %.1f in flight at the end\n",
+                done, failed, unchanged, skipped, retried,
+                secs > 0 ? done / secs : 0, limiter.limit);
+    }
+    if (synth)
+    {
+        struct timespec now;
+        double secs;
+        failed += synthesize(&store, &manifest, region.count ? &region : NULL,
+                             synth, &made);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        secs = (now.tv_sec - end.tv_sec) + (now.tv_nsec - end.tv_nsec) / 1e9;
+        fprintf(stderr, "%ld tiles made from zoom %d up, %.1f tiles/s\n", made,
+                synth, secs > 0 ? made / secs : 0);
+    }
+    print_savings(&store, &manifest);
+    ret = failed != 0;
+
+cleanup:
+    if (transfers)
+    {
+        for (i = 0; i < maxconn; ++i)
+        {
+            if (transfers[i].curl)
+            {
+                curl_multi_remove_handle(multi, transfers[i].curl);
+                curl_easy_cleanup(transfers[i].curl);
+            }
+            free(transfers[i].body.data);
+            curl_slist_free_all(transfers[i].headers);
+        }
+    }
+    if (manifest.log && manifest_close(&manifest))
+    {
+        fprintf(stderr, "Cannot write %s\n", manifest.path);
+        ret = 1;
+    }
+    free(manifest.path);
+    if (store_close(&store))
+    {
+        fprintf(stderr, "Cannot write the index of %s: %s\n", archive,
+                strerror(errno));
+        ret = 1;
+    }
+    if (multi)
+        curl_multi_cleanup(multi);
+    free(transfers);
+    free(idle);
+    free(retries.items);
+    tile_iter_free(&it);
+    free(region.edges);
+    curl_global_cleanup();
+    return ret;
+}
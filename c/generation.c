@@ -2,7 +2,11 @@
  * children each, how many people are there in the family after n generations?
  * the mother side not included */
 /* n specified in argv[1], defaults to 1 */
+/* With -s, print the answers for 1..n, one per line */
 /* UPDATE: this program actually calculates OEIS:A000522 */
+/* UPDATE: arbitrary precision. a(n) = sum n!/k! is evaluated by binary
+ * splitting with Karatsuba multiplication, so n = 100000 takes seconds.
+ * Numbers are stored in base 10^9 so that printing is linear. */
 /*
  *  generation.c
  *  Copyright (C) 2017 Zhang Maiyun <me@maiyun.me>
@@ -21,20 +25,319 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Each limb holds 9 decimal digits */
+#define BASE 1000000000U
+#define BASE_DIGITS 9
+/* Below this many limbs schoolbook multiplication is faster */
+#define KARATSUBA_THRESHOLD 32
+
+typedef uint32_t limb_t;
+
+/* Little-endian array of limbs, no leading zero limbs unless it is zero */
+struct bignum
+{
+    limb_t *limb;
+    size_t len;
+};
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+    if (!p)
+    {
+        fprintf(stderr, "malloc failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+static size_t normalized(const limb_t *a, size_t n)
+{
+    while (n > 1 && a[n - 1] == 0)
+        --n;
+    return n;
+}
+
+/* r[0..nr) += a[0..na), nr >= na, the result must fit */
+static void add_to(limb_t *r, size_t nr, const limb_t *a, size_t na)
+{
+    limb_t carry = 0;
+    size_t i;
+    for (i = 0; i < na; ++i)
+    {
+        limb_t t = r[i] + a[i] + carry;
+        carry = t >= BASE;
+        r[i] = carry ? t - BASE : t;
+    }
+    for (; carry && i < nr; ++i)
+    {
+        limb_t t = r[i] + 1;
+        carry = t == BASE;
+        r[i] = carry ? 0 : t;
+    }
+}
+
+/* r[0..nr) -= a[0..na), nr >= na, r must not be less than a */
+static void sub_from(limb_t *r, size_t nr, const limb_t *a, size_t na)
+{
+    limb_t borrow = 0;
+    size_t i;
+    for (i = 0; i < na; ++i)
+    {
+        limb_t s = a[i] + borrow;
+        borrow = r[i] < s;
+        r[i] = borrow ? r[i] + BASE - s : r[i] - s;
+    }
+    for (; borrow && i < nr; ++i)
+    {
+        borrow = r[i] == 0;
+        r[i] = borrow ? BASE - 1 : r[i] - 1;
+    }
+}
+
+/* r[0..na+nb) = a * b, r must not overlap with a or b */
+static void mul_basecase(const limb_t *a, size_t na, const limb_t *b,
+                         size_t nb, limb_t *r)
+{
+    size_t i, j;
+    memset(r, 0, sizeof(limb_t) * (na + nb));
+    for (i = 0; i < na; ++i)
+    {
+        uint64_t carry = 0;
+        if (a[i] == 0)
+            continue;
+        for (j = 0; j < nb; ++j)
+        {
+            uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+            carry = t / BASE;
+            r[i + j] = (limb_t)(t % BASE);
+        }
+        r[i + nb] = (limb_t)carry;
+    }
+}
+
+/* r[0..na+nb) = a * b, r must not overlap with a or b */
+static void mul(const limb_t *a, size_t na, const limb_t *b, size_t nb,
+                limb_t *r)
+{
+    if (na < nb)
+    {
+        const limb_t *tp = a;
+        size_t tn = na;
+        a = b;
+        na = nb;
+        b = tp;
+        nb = tn;
+    }
+    if (nb < KARATSUBA_THRESHOLD)
+        mul_basecase(a, na, b, nb, r);
+    else if (2 * nb <= na)
+    {
+        /* Unbalanced: multiply b with nb-sized slices of a */
+        limb_t *t = xmalloc(sizeof(limb_t) * 2 * nb);
+        size_t off;
+        memset(r, 0, sizeof(limb_t) * (na + nb));
+        for (off = 0; off < na; off += nb)
+        {
+            size_t n = na - off < nb ? na - off : nb;
+            mul(a + off, n, b, nb, t);
+            add_to(r + off, na + nb - off, t, n + nb);
+        }
+        free(t);
+    }
+    else
+    {
+        /* Karatsuba: (a1 B^m + a0)(b1 B^m + b0)
+         * = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0 */
+        size_t m = na / 2;
+        size_t nsa = na - m + 1, nsb = (nb - m > m ? nb - m : m) + 1;
+        limb_t *sa = xmalloc(sizeof(limb_t) * (nsa + nsb + nsa + nsb));
+        limb_t *sb = sa + nsa;
+        limb_t *z1 = sb + nsb;
+
+        mul(a, m, b, m, r);
+        mul(a + m, na - m, b + m, nb - m, r + 2 * m);
+
+        memset(sa, 0, sizeof(limb_t) * (nsa + nsb));
+        memcpy(sa, a + m, sizeof(limb_t) * (na - m));
+        add_to(sa, nsa, a, m);
+        if (nb - m > m)
+        {
+            memcpy(sb, b + m, sizeof(limb_t) * (nb - m));
+            add_to(sb, nsb, b, m);
+        }
+        else
+        {
+            memcpy(sb, b, sizeof(limb_t) * m);
+            add_to(sb, nsb, b + m, nb - m);
+        }
+        mul(sa, nsa, sb, nsb, z1);
+        sub_from(z1, nsa + nsb, r, 2 * m);
+        sub_from(z1, nsa + nsb, r + 2 * m, na + nb - 2 * m);
+        add_to(r + m, na + nb - m, z1,
+               normalized(z1, nsa + nsb) < na + nb - m
+                   ? normalized(z1, nsa + nsb)
+                   : na + nb - m);
+        free(sa);
+    }
+}
+
+static struct bignum bn_from(limb_t v)
+{
+    struct bignum r;
+    r.limb = xmalloc(sizeof(limb_t) * 2);
+    r.limb[0] = v % BASE;
+    r.limb[1] = v / BASE;
+    r.len = normalized(r.limb, 2);
+    return r;
+}
+
+static struct bignum bn_mul(struct bignum a, struct bignum b)
+{
+    struct bignum r;
+    r.limb = xmalloc(sizeof(limb_t) * (a.len + b.len));
+    mul(a.limb, a.len, b.limb, b.len, r.limb);
+    r.len = normalized(r.limb, a.len + b.len);
+    return r;
+}
+
+/* a = a * m + c in place, growing it if needed; m, c < BASE */
+static void bn_muladd_small(struct bignum *a, limb_t m, limb_t c,
+                            size_t *cap)
+{
+    uint64_t carry = c;
+    size_t i;
+    for (i = 0; i < a->len; ++i)
+    {
+        uint64_t t = (uint64_t)a->limb[i] * m + carry;
+        carry = t / BASE;
+        a->limb[i] = (limb_t)(t % BASE);
+    }
+    if (carry)
+    {
+        if (a->len == *cap)
+        {
+            limb_t *tmp;
+            *cap *= 2;
+            tmp = realloc(a->limb, sizeof(limb_t) * *cap);
+            if (!tmp)
+            {
+                fprintf(stderr, "malloc failed\n");
+                exit(1);
+            }
+            a->limb = tmp;
+        }
+        a->limb[a->len++] = (limb_t)carry;
+    }
+}
+
+/* Write a in decimal followed by a newline */
+static void bn_print(struct bignum a, FILE *out)
+{
+    char *buf = xmalloc(a.len * BASE_DIGITS + 2);
+    char *p = buf;
+    size_t i = a.len - 1;
+    p += sprintf(p, "%u", (unsigned)a.limb[i]);
+    while (i-- > 0)
+    {
+        limb_t v = a.limb[i];
+        int d;
+        for (d = BASE_DIGITS - 1; d >= 0; --d)
+        {
+            p[d] = '0' + v % 10;
+            v /= 10;
+        }
+        p += BASE_DIGITS;
+    }
+    *p++ = '\n';
+    fwrite(buf, 1, p - buf, out);
+    free(buf);
+}
+
+/* For lo <= k <= hi, compute
+ *   *f = sum(prod(i, k < i <= hi), k) and *p = prod(i, lo < i <= hi).
+ * Splitting at mid,
+ *   f(lo, hi) = f(lo, mid) * (mid + 1) * p(mid + 1, hi) + f(mid + 1, hi)
+ */
+static void split(limb_t lo, limb_t hi, struct bignum *f, struct bignum *p)
+{
+    if (hi - lo < 16)
+    {
+        size_t fcap = 2, pcap = 2;
+        limb_t i;
+        *f = bn_from(1);
+        *p = bn_from(1);
+        for (i = lo + 1; i <= hi; ++i)
+        {
+            bn_muladd_small(f, i, 1, &fcap);
+            bn_muladd_small(p, i, 0, &pcap);
+        }
+    }
+    else
+    {
+        limb_t mid = lo + (hi - lo) / 2;
+        struct bignum fl, pl, fr, pr, pm, t;
+        size_t cap;
+        split(lo, mid, &fl, &pl);
+        split(mid + 1, hi, &fr, &pr);
+        /* pm = (mid + 1) * p(mid + 1, hi) */
+        cap = pr.len;
+        bn_muladd_small(&pr, mid + 1, 0, &cap);
+        pm = pr;
+        t = bn_mul(fl, pm);
+        *p = bn_mul(pl, pm);
+        free(fl.limb);
+        free(pl.limb);
+        free(pm.limb);
+        /* f = t + fr, t is always the longer one */
+        f->limb = realloc(t.limb, sizeof(limb_t) * (t.len + 1));
+        if (!f->limb)
+        {
+            fprintf(stderr, "malloc failed\n");
+            exit(1);
+        }
+        f->limb[t.len] = 0;
+        add_to(f->limb, t.len + 1, fr.limb, fr.len);
+        f->len = normalized(f->limb, t.len + 1);
+        free(fr.limb);
+    }
+}
 
 int main(int argc, char **argv)
 {
-    unsigned long long men = atoi(argc > 1 ? argv[1] : "1");
-    unsigned count = men;         /* count for generations */
-    unsigned long long total = 1; /* People in total */
-    total += men;
-    while (--count)
+    int sequence = argc > 1 && strcmp(argv[1], "-s") == 0;
+    const char *arg = argc > 1 + sequence ? argv[1 + sequence] : "1";
+    long men = atol(arg);
+    if (men < 0 || men >= (long)BASE)
+    {
+        fprintf(stderr, "n out of range: %s\n", arg);
+        return 1;
+    }
+    if (sequence)
+    {
+        /* a(n) = n * a(n - 1) + 1 */
+        size_t cap = 2;
+        struct bignum total = bn_from(1);
+        long n;
+        for (n = 1; n <= men; ++n)
+        {
+            bn_muladd_small(&total, n, 1, &cap);
+            bn_print(total, stdout);
+        }
+        free(total.limb);
+    }
+    else
     {
-        men *= count;
-        total += men;
+        struct bignum total, product;
+        split(0, men, &total, &product);
+        bn_print(total, stdout);
+        free(total.limb);
+        free(product.limb);
     }
-    printf("%lld\n", total);
     return 0;
 }
@@ -18,110 +18,663 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <ctype.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <slib.h>
 #include <slib/getopt.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-#define MAXLEN 262144
+/* Size of the blocks read from input that cannot be mapped */
+#define BLOCK_SIZE 65536
+/* Size of the output buffers */
+#define OUTPUT_BUFFER 65536
+/* Number of formatted durations remembered */
+#define HITS_CACHE_BITS 6
+#define HITS_CACHE (1 << HITS_CACHE_BITS)
+/* Longest text of a note besides its "Hi "/"Lo " marks */
+#define NOTE_TEXT 64
 
-int getlen(char **stack)
+/* The binary event stream is EVENT_MAGIC followed by one 8-byte record per
+ * note: pitch (0 for a rest, 1-7 for do to ti), octave shift (signed),
+ * two zero bytes and the duration in hits as a little-endian IEEE 754
+ * single. */
+#define EVENT_MAGIC "MCE1"
+#define EVENT_SIZE 8
+
+/* PCM output: mono 8 kHz unsigned 8-bit, like 8bit.c */
+#define RENDER_RATE 8000
+/* Default hits per minute */
+#define RENDER_TEMPO 120.0
+/* Frequency of do without octave marks (C4) */
+#define RENDER_DO 261.6256
+/* Octave marks beyond this many are ignored */
+#define RENDER_OCTAVES 3
+#define RENDER_SEMITONES (12 * (2 * RENDER_OCTAVES + 1))
+#define RENDER_MIDDLE (12 * RENDER_OCTAVES)
+#define RENDER_TABLE_BITS 10
+#define RENDER_TABLE (1 << RENDER_TABLE_BITS)
+/* Samples per envelope step */
+#define RENDER_BLOCK 32
+/* Notes sounding at once, including release tails */
+#define RENDER_VOICES 4
+/* Envelope: attack in samples, per-sample decay and release factors */
+#define RENDER_ATTACK 64
+#define RENDER_DECAY 0.9995f
+#define RENDER_SUSTAIN 0.6f
+#define RENDER_RELEASE 0.99f
+/* Level of one voice, leaving room for overlapping tails */
+#define RENDER_GAIN 0.4f
+
+/* One parsed note */
+struct note
+{
+    int pitch;
+    int octave;
+    double hits;
+    /* The ',' and '\'' marks in the order written */
+    char *marks;
+    size_t nmarks;
+    size_t marks_cap;
+};
+
+/* Character classes */
+enum
+{
+    C_OTHER = 0,
+    C_NOTE,
+    C_BAD_NOTE,
+    C_HI,
+    C_LO,
+    C_HALF,
+    C_DOUBLE,
+    C_DOT,
+    C_SPACE,
+    N_CLASSES
+};
+
+static const unsigned char CLASSES[256] = {
+    [0] = C_SPACE,      ['\n'] = C_SPACE,   ['\r'] = C_SPACE,
+    [' '] = C_SPACE,    ['0'] = C_NOTE,     ['1'] = C_NOTE,
+    ['2'] = C_NOTE,     ['3'] = C_NOTE,     ['4'] = C_NOTE,
+    ['5'] = C_NOTE,     ['6'] = C_NOTE,     ['7'] = C_NOTE,
+    ['8'] = C_BAD_NOTE, ['9'] = C_BAD_NOTE, [','] = C_HI,
+    ['\''] = C_LO,      ['_'] = C_HALF,     ['-'] = C_DOUBLE,
+    ['.'] = C_DOT,
+};
+
+/* Parser states: whether a note is waiting for more modifiers */
+enum
+{
+    S_IDLE = 0,
+    S_NOTE,
+    N_STATES
+};
+
+/* What to do with a character */
+enum
+{
+    A_SKIP = 0,
+    A_START,
+    A_NEXT,
+    A_MODIFY,
+    A_ERR_MODIFIER,
+    A_ERR_NUMBER,
+    A_ERR_SYMBOL
+};
+
+static const unsigned char ACTIONS[N_STATES][N_CLASSES] = {
+    [S_IDLE] =
+        {
+            [C_OTHER] = A_ERR_SYMBOL,
+            [C_NOTE] = A_START,
+            [C_BAD_NOTE] = A_ERR_NUMBER,
+            [C_HI] = A_ERR_MODIFIER,
+            [C_LO] = A_ERR_MODIFIER,
+            [C_HALF] = A_ERR_MODIFIER,
+            [C_DOUBLE] = A_ERR_MODIFIER,
+            [C_DOT] = A_ERR_MODIFIER,
+            [C_SPACE] = A_SKIP,
+        },
+    [S_NOTE] =
+        {
+            [C_OTHER] = A_ERR_SYMBOL,
+            [C_NOTE] = A_NEXT,
+            [C_BAD_NOTE] = A_ERR_NUMBER,
+            [C_HI] = A_MODIFY,
+            [C_LO] = A_MODIFY,
+            [C_HALF] = A_MODIFY,
+            [C_DOUBLE] = A_MODIFY,
+            [C_DOT] = A_MODIFY,
+            [C_SPACE] = A_SKIP,
+        },
+};
+
+static const char *const NAMES[] = {"stop", "do", "re", "mi",
+                                    "fa",   "sol", "la", "ti"};
+
+/* PCM renderer.
+ * Every note is played from a wavetable of its pitch, band-limited below
+ * the Nyquist frequency, by a phase accumulator. Envelopes run at control
+ * rate: each block of up to RENDER_BLOCK samples gets a linear ramp, so the
+ * voices are mixed with plain multiply-adds. A note released at its end
+ * keeps sounding over the next one for a short while. */
+
+struct voice
+{
+    const float *table;
+    /* Position in the table as a fraction of 2^32 */
+    uint32_t phase;
+    uint32_t step;
+    /* Samples until release */
+    int64_t gate;
+    float level;
+    bool attacking;
+};
+
+struct renderer
+{
+    FILE *pcm;
+    double samples_per_hit;
+    /* Total duration of the notes so far and the samples written */
+    double hits;
+    int64_t pos;
+    /* Indexed by the semitone from the lowest note, RENDER_MIDDLE is do */
+    float *tables[RENDER_SEMITONES];
+    struct voice voices[RENDER_VOICES];
+    int nvoices;
+    float osc[RENDER_BLOCK];
+    float mix[RENDER_BLOCK];
+    uint8_t out[RENDER_BLOCK];
+};
+
+/* Semitones above do of each pitch, rests excluded */
+static const int STEPS[] = {0, 0, 2, 4, 5, 7, 9, 11};
+
+/* Wavetable of the given semitone, an organ-like tone that has all its
+ * harmonics below 3800 Hz. The fundamental is kept up to the Nyquist
+ * frequency, pitches above that are silent. One extra sample is kept for
+ * interpolation */
+static const float *render_table(struct renderer *r, int semitone)
+{
+    double freq = RENDER_DO * pow(2, (semitone - RENDER_MIDDLE) / 12.0);
+    static const double AMPLITUDES[] = {1, 0.5, 0.3, 0.2, 0.1, 0.05};
+    float *table, peak = 0;
+    int i, h;
+    if (r->tables[semitone])
+        return r->tables[semitone];
+    if (!(table = malloc(sizeof(float) * (RENDER_TABLE + 1))))
+        return NULL;
+    for (i = 0; i < RENDER_TABLE; ++i)
+    {
+        double sum = 0;
+        for (h = 1; h <= 6 && (h == 1 ? freq < RENDER_RATE / 2.0
+                                       : h * freq < 3800);
+             ++h)
+            sum += AMPLITUDES[h - 1] * sin(2 * M_PI * h * i / RENDER_TABLE);
+        table[i] = sum;
+        if (fabsf(table[i]) > peak)
+            peak = fabsf(table[i]);
+    }
+    for (i = 0; i < RENDER_TABLE && peak > 0; ++i)
+        table[i] /= peak;
+    table[RENDER_TABLE] = table[0];
+    return r->tables[semitone] = table;
+}
+
+/* Fill r->osc with n samples of the voice */
+static void render_oscillator(struct renderer *r, struct voice *v, int n)
+{
+    const int shift = 32 - RENDER_TABLE_BITS;
+    const float scale = 1.0f / (1u << shift);
+    int i;
+    for (i = 0; i < n; ++i)
+    {
+        uint32_t idx = v->phase >> shift;
+        float frac = (v->phase & ((1u << shift) - 1)) * scale;
+        r->osc[i] = v->table[idx] + frac * (v->table[idx + 1] - v->table[idx]);
+        v->phase += v->step;
+    }
+}
+
+/* mix[i] += osc[i] * (level + i * slope) */
+static void render_mix(float *mix, const float *osc, float level, float slope,
+                       int n)
 {
     int i = 0;
-    for (; (*stack)[i]; ++i)
-        ;
-    return i;
+#ifdef __SSE2__
+    __m128 ramp =
+        _mm_add_ps(_mm_set1_ps(level),
+                   _mm_mul_ps(_mm_set1_ps(slope), _mm_setr_ps(0, 1, 2, 3)));
+    const __m128 step = _mm_set1_ps(4 * slope);
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(mix + i,
+                      _mm_add_ps(_mm_loadu_ps(mix + i),
+                                 _mm_mul_ps(_mm_loadu_ps(osc + i), ramp)));
+        ramp = _mm_add_ps(ramp, step);
+    }
+#endif
+    for (; i < n; ++i)
+        mix[i] += osc[i] * (level + i * slope);
+}
+
+/* Mixed samples in [-1, 1] to unsigned 8-bit, as 8bit writes them */
+static void render_quantize(const float *src, uint8_t *dst, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(128.0f);
+    const __m128i offset = _mm_set1_epi32(128);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i a = _mm_add_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale)), offset);
+        __m128i b = _mm_add_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale)),
+            offset);
+        /* Saturating packs do the clipping */
+        _mm_storel_epi64((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                          _mm_setzero_si128()));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        long v = lrintf(src[i] * 128.0f) + 128;
+        dst[i] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+    }
 }
 
-int push(char **stack, char c)
+/* Where the envelope of a voice is after n more samples */
+static float render_envelope(struct voice *v, int n)
 {
-    if (getlen(stack) == MAXLEN)
-        return -1;
-    (*stack)[getlen(stack)] = c;
+    if (v->gate <= 0)
+        return v->level * powf(RENDER_RELEASE, n);
+    if (v->attacking)
+    {
+        float level = v->level + n * (1.0f / RENDER_ATTACK);
+        if (level < 1)
+            return level;
+        v->attacking = false;
+        return 1;
+    }
+    return RENDER_SUSTAIN + (v->level - RENDER_SUSTAIN) * powf(RENDER_DECAY, n);
+}
+
+/* Write samples up to `end` */
+static int render_until(struct renderer *r, int64_t end)
+{
+    while (r->pos < end)
+    {
+        int n = end - r->pos < RENDER_BLOCK ? end - r->pos : RENDER_BLOCK;
+        int i;
+        /* Envelopes change at the end of a gate, so no block crosses one */
+        for (i = 0; i < r->nvoices; ++i)
+            if (r->voices[i].gate > 0 && r->voices[i].gate < n)
+                n = r->voices[i].gate;
+        memset(r->mix, 0, sizeof(float) * n);
+        for (i = 0; i < r->nvoices; ++i)
+        {
+            struct voice *v = &r->voices[i];
+            float next = render_envelope(v, n);
+            render_oscillator(r, v, n);
+            render_mix(r->mix, r->osc, v->level * RENDER_GAIN,
+                       (next - v->level) * RENDER_GAIN / n, n);
+            v->level = next;
+            v->gate -= n;
+            /* Done when inaudible */
+            if (v->gate <= 0 && v->level < 1.0f / 512)
+            {
+                memmove(v, v + 1,
+                        sizeof(struct voice) * (--r->nvoices - i));
+                --i;
+            }
+        }
+        render_quantize(r->mix, r->out, n);
+        if (fwrite(r->out, 1, n, r->pcm) != (size_t)n)
+        {
+            prterr("Fwrite(pcm) failed.");
+            return 1;
+        }
+        r->pos += n;
+    }
     return 0;
 }
 
-int numeric(FILE *otpt, char *stack, int c, double hits)
+/* Play a note after the previous ones */
+static int render_note(struct renderer *r, const struct note *note)
 {
-    if (!getlen(&stack))
+    int64_t end;
+    r->hits += note->hits;
+    end = llround(r->hits * r->samples_per_hit);
+    if (note->pitch != 0 && end > r->pos)
     {
-        /* First iter */
-        push(&stack, c);
+        int octave = note->octave < -RENDER_OCTAVES  ? -RENDER_OCTAVES
+                     : note->octave > RENDER_OCTAVES ? RENDER_OCTAVES
+                                                     : note->octave;
+        int semitone = RENDER_MIDDLE + 12 * octave + STEPS[note->pitch];
+        struct voice *v;
+        double freq = RENDER_DO * pow(2, (semitone - RENDER_MIDDLE) / 12.0);
+        if (r->nvoices == RENDER_VOICES)
+        {
+            /* Cut off the oldest tail */
+            memmove(r->voices, r->voices + 1,
+                    sizeof(struct voice) * --r->nvoices);
+        }
+        v = &r->voices[r->nvoices];
+        if (!(v->table = render_table(r, semitone)))
+        {
+            prterr("Malloc failed.");
+            return 1;
+        }
+        v->phase = 0;
+        v->step = (uint32_t)llround(freq / RENDER_RATE * 4294967296.0);
+        v->gate = end - r->pos;
+        v->level = 0;
+        v->attacking = true;
+        ++r->nvoices;
     }
-    switch (stack[0])
+    return render_until(r, end);
+}
+
+/* Let the last notes ring out */
+static int render_finish(struct renderer *r)
+{
+    while (r->nvoices)
+        if (render_until(r, r->pos + RENDER_BLOCK))
+            return 1;
+    return 0;
+}
+
+static void render_free(struct renderer *r)
+{
+    int i;
+    for (i = 0; i < RENDER_SEMITONES; ++i)
+        free(r->tables[i]);
+}
+
+/* Where the notes go */
+struct output
+{
+    FILE *text;
+    /* NULL if not wanted */
+    FILE *events;
+    struct renderer *renderer;
+    /* Text not written out yet; a note never takes more than its marks and
+     * NOTE_TEXT bytes */
+    char *buf;
+    size_t len;
+    size_t cap;
+    /* Formatted durations, indexed by a hash of the value */
+    struct
     {
-        case '0':
-            fprintf(otpt, "stop for ");
-            break;
-        case '1':
-            fprintf(otpt, "do for ");
-            break;
-        case '2':
-            fprintf(otpt, "re for ");
-            break;
-        case '3':
-            fprintf(otpt, "mi for ");
-            break;
-        case '4':
-            fprintf(otpt, "fa for ");
-            break;
-        case '5':
-            fprintf(otpt, "sol for ");
-            break;
-        case '6':
-            fprintf(otpt, "la for ");
-            break;
-        case '7':
-            fprintf(otpt, "ti for ");
-            break;
-        default:
-            fprintf(stderr, "Invalid number: %c\n", stack[0]);
+        double hits;
+        size_t len;
+        char text[32];
+    } cache[HITS_CACHE];
+};
+
+struct parser
+{
+    int state;
+    struct note note;
+    struct output *out;
+};
+
+/* Text of a duration as "%lf" prints it */
+static const char *format_hits(struct output *out, double hits, size_t *len)
+{
+    uint64_t bits;
+    size_t slot;
+    memcpy(&bits, &hits, sizeof(bits));
+    /* Fibonacci hashing; the low bits of usual durations are all zero */
+    slot = (bits * 0x9E3779B97F4A7C15u) >> (64 - HITS_CACHE_BITS);
+    if (out->cache[slot].hits != hits || !out->cache[slot].len)
+    {
+        int n = snprintf(out->cache[slot].text, sizeof(out->cache[slot].text),
+                         "%lf", hits);
+        out->cache[slot].hits = hits;
+        /* Only absurd durations do not fit */
+        out->cache[slot].len = n < 0 ? 0
+                               : (size_t)n < sizeof(out->cache[slot].text)
+                                   ? (size_t)n
+                                   : sizeof(out->cache[slot].text) - 1;
+    }
+    *len = out->cache[slot].len;
+    return out->cache[slot].text;
+}
+
+/* Write the buffered text out */
+static void flush_text(struct output *out)
+{
+    fwrite(out->buf, 1, out->len, out->text);
+    fflush(out->text);
+    out->len = 0;
+}
+
+/* Make sure n more bytes fit in the text buffer */
+static int reserve_text(struct output *out, size_t n)
+{
+    if (out->len + n > out->cap)
+    {
+        flush_text(out);
+        if (n > out->cap)
+        {
+            char *tmp = realloc(out->buf, n);
+            if (!tmp)
+            {
+                prterr("Realloc failed.");
+                return 1;
+            }
+            out->buf = tmp;
+            out->cap = n;
+        }
+    }
+    return 0;
+}
+
+static void write_event(FILE *events, const struct note *note)
+{
+    unsigned char record[EVENT_SIZE];
+    float hits = (float)note->hits;
+    uint32_t bits;
+    int i;
+    memcpy(&bits, &hits, sizeof(bits));
+    record[0] = note->pitch;
+    record[1] = (unsigned char)(int8_t)(note->octave > 127    ? 127
+                                        : note->octave < -128 ? -128
+                                                              : note->octave);
+    record[2] = record[3] = 0;
+    for (i = 0; i < 4; ++i)
+        record[4 + i] = bits >> (8 * i);
+    fwrite(record, 1, EVENT_SIZE, events);
+}
+
+/* Write out a complete note */
+static int emit(struct output *out, const struct note *note)
+{
+    static const size_t NAME_LENS[] = {4, 2, 2, 2, 2, 3, 2, 2};
+    const char *hits;
+    char *p;
+    size_t i, hits_len;
+    if (reserve_text(out, 3 * note->nmarks + NOTE_TEXT))
+        return 1;
+    p = out->buf + out->len;
+    memcpy(p, NAMES[note->pitch], NAME_LENS[note->pitch]);
+    p += NAME_LENS[note->pitch];
+    memcpy(p, " for ", 5);
+    p += 5;
+    for (i = 0; i < note->nmarks; ++i, p += 3)
+        memcpy(p, note->marks[i] == ',' ? "Hi " : "Lo ", 3);
+    hits = format_hits(out, note->hits, &hits_len);
+    memcpy(p, hits, hits_len);
+    p += hits_len;
+    memcpy(p, " hits\n", 6);
+    p += 6;
+    out->len = p - out->buf;
+    if (out->events)
+        write_event(out->events, note);
+    if (out->renderer)
+        return render_note(out->renderer, note);
+    return 0;
+}
+
+/* Effect of each modifier class on a note. '.' adds half of the current
+ * duration, which is the same as multiplying it by 1.5 */
+static const double HIT_FACTORS[N_CLASSES] = {
+    [C_HI] = 1, [C_LO] = 1, [C_HALF] = 0.5, [C_DOUBLE] = 2, [C_DOT] = 1.5,
+};
+static const int OCTAVE_STEPS[N_CLASSES] = {[C_HI] = 1, [C_LO] = -1};
+
+/* Apply a modifier to the current note */
+static int modify(struct note *note, unsigned char c)
+{
+    int cls = CLASSES[c];
+    note->hits *= HIT_FACTORS[cls];
+    if (!OCTAVE_STEPS[cls])
+        return 0;
+    note->octave += OCTAVE_STEPS[cls];
+    if (note->nmarks == note->marks_cap)
+    {
+        size_t cap = note->marks_cap ? 2 * note->marks_cap : 16;
+        char *tmp = realloc(note->marks, cap);
+        if (!tmp)
+        {
+            prterr("Realloc failed.");
             return 1;
+        }
+        note->marks = tmp;
+        note->marks_cap = cap;
     }
-    for (int i = 1; i <= getlen(&stack); i++)
+    note->marks[note->nmarks++] = c;
+    return 0;
+}
+
+/* Write out the last note */
+static void parse_end(struct parser *ps)
+{
+    if (ps->state == S_NOTE)
+        emit(ps->out, &ps->note);
+    ps->state = S_IDLE;
+    flush_text(ps->out);
+}
+
+/* Feed a block of input to the parser. Returns nonzero on a syntax error */
+static int parse(struct parser *ps, const unsigned char *buf, size_t len)
+{
+    const unsigned char *end = buf + len;
+    for (; buf < end; ++buf)
     {
-        switch (stack[i])
+        unsigned char c = *buf;
+        switch (ACTIONS[ps->state][CLASSES[c]])
         {
-            case ',':
-                fprintf(otpt, "Hi ");
-                break;
-            case '\'':
-                fprintf(otpt, "Lo ");
+            case A_SKIP:
                 break;
-            case '_':
-                hits /= 2;
+            case A_NEXT:
+                if (emit(ps->out, &ps->note))
+                    return 1;
+                /* Fall through */
+            case A_START:
+                ps->state = S_NOTE;
+                ps->note.pitch = c - '0';
+                ps->note.octave = 0;
+                ps->note.hits = 1;
+                ps->note.nmarks = 0;
                 break;
-            case '-':
-                hits *= 2;
-                break;
-            case '.':
-                hits += hits / 2;
-                break;
-            default:
+            case A_MODIFY:
+                if (modify(&ps->note, c))
+                    return 1;
                 break;
+            case A_ERR_MODIFIER:
+                parse_end(ps);
+                fprintf(stderr, "Modifier without a note: %c\n", c);
+                return 1;
+            case A_ERR_NUMBER:
+                parse_end(ps);
+                fprintf(stderr, "Invalid number: %c\n", c);
+                return 1;
+            case A_ERR_SYMBOL:
+                parse_end(ps);
+                fprintf(stderr, "Unknown symble: %c\n", c);
+                return 1;
         }
     }
-    fprintf(otpt, "%lf hits\n", hits);
-    hits = 1;
-    memset(stack, 0, sizeof(char) * MAXLEN);
     return 0;
 }
 
-void check_inpt(FILE **inpt, FILE **otpt, int argc, char **argv)
+/* Parse the whole input in one pass, mapped if it is a regular file and in
+ * blocks otherwise */
+static int parse_file(FILE *inpt, struct parser *ps)
 {
-    char *usage = "%s [inputFile] [-o outputFile] or %s -h\n\nIf no input "
-                  "file provided, read STDIN;\nif no output file provided, "
-                  "write STDOUT.\n";
+    int fd = fileno(inpt);
+    struct stat statinfo;
+    unsigned char *buf;
+    ssize_t len;
+    int ret = 0;
+
+    if (fstat(fd, &statinfo) == 0 && S_ISREG(statinfo.st_mode) &&
+        statinfo.st_size > 0)
+    {
+        void *map = mmap(NULL, statinfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, statinfo.st_size, MADV_SEQUENTIAL);
+            ret = parse(ps, map, statinfo.st_size);
+            munmap(map, statinfo.st_size);
+            parse_end(ps);
+            return ret;
+        }
+    }
+    if (!(buf = malloc(BLOCK_SIZE)))
+    {
+        prterr("Malloc failed.");
+        return 1;
+    }
+    while ((len = read(fd, buf, BLOCK_SIZE)) != 0)
+    {
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "read: %s\n", strerror(errno));
+            ret = 1;
+            break;
+        }
+        if ((ret = parse(ps, buf, len)) != 0)
+            break;
+    }
+    free(buf);
+    parse_end(ps);
+    return ret;
+}
+
+void check_inpt(FILE **inpt, FILE **otpt, FILE **evts, FILE **pcm,
+                double *tempo, int argc, char **argv)
+{
+    char *usage =
+        "%s [inputFile] [-o outputFile] [-e eventFile] [-p pcmFile "
+        "[-t tempo]] or %s -h\n\n"
+        "If no input file provided, read STDIN;\nif no output file "
+        "provided, write STDOUT.\nWith -e, also write the notes as "
+        "binary events to eventFile.\nWith -p, also play the notes into "
+        "pcmFile as mono 8kHz 8-bit PCM,\nat tempo hits per minute "
+        "(default 120).\n";
     if (argc != 1)
     {
         int ch;
         struct stat statinfo;
         opterrGS = 0;
-        while ((ch = getoptGS(argc, argv, ":o:h")) != -1)
+        while ((ch = getoptGS(argc, argv, ":o:e:p:t:h")) != -1)
         {
             switch (ch)
             {
@@ -133,15 +686,40 @@ void check_inpt(FILE **inpt, FILE **otpt, int argc, char **argv)
                         exit(1);
                     }
                     break;
+                case 'e':
+                    *evts = fopen(optargGS, "wb");
+                    if (!(*evts))
+                    {
+                        prterr("Fopen(events) failed.");
+                        exit(1);
+                    }
+                    break;
+                case 'p':
+                    *pcm = fopen(optargGS, "wb");
+                    if (!(*pcm))
+                    {
+                        prterr("Fopen(pcm) failed.");
+                        exit(1);
+                    }
+                    break;
+                case 't':
+                    if ((*tempo = atof(optargGS)) <= 0)
+                    {
+                        fprintf(stderr, "%s: invalid tempo: %s\n", argv[0],
+                                optargGS);
+                        exit(1);
+                    }
+                    break;
                 case 'h':
-                    printf(usage, argv[0]);
+                    printf(usage, argv[0], argv[0]);
                     exit(0);
                 case ':':
-                    fprintf(stderr, "%s: '-o': Missing argument\n", argv[0]);
+                    fprintf(stderr, "%s: '-%c': Missing argument\n", argv[0],
+                            optoptGS);
                     exit(1);
                 case '?':
                     fprintf(stderr, "%s: invalid option -- '%c'\n", argv[0],
-                            ch);
+                            optoptGS);
                     exit(1);
                 default:
                     break;
@@ -178,44 +756,53 @@ void check_inpt(FILE **inpt, FILE **otpt, int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-    FILE *inpt = NULL, *otpt = NULL;
-    double hits = 1;
-    char *stack = malloc(sizeof(char) * MAXLEN);
-    char c;
-    check_inpt(&inpt, &otpt, argc, argv);
-    while ((c = getc(inpt)) != EOF)
+    FILE *inpt = NULL, *otpt = NULL, *evts = NULL, *pcm = NULL;
+    double tempo = RENDER_TEMPO;
+    struct output out;
+    struct parser ps;
+    struct renderer renderer;
+    check_inpt(&inpt, &otpt, &evts, &pcm, &tempo, argc, argv);
+
+    memset(&out, 0, sizeof(out));
+    out.text = otpt;
+    out.events = evts;
+    if (!(out.buf = malloc(OUTPUT_BUFFER)))
     {
-        if (isdigit(c))
-        {
-            if (numeric(otpt, stack, c, hits))
-                goto out;
-        }
-        else
-        {
-            switch (c)
-            {
-                case ',':
-                case '\'':
-                case '_':
-                case '-':
-                case '.':
-                    push(&stack, c);
-                    break;
-                case 0:
-                case '\n':
-                case ' ':
-                    continue;
-                default:
-                    fprintf(stderr, "Unknown symble: %c\n", c);
-                    goto out;
-            }
-        }
+        prterr("Malloc failed.");
+        return 1;
+    }
+    out.cap = OUTPUT_BUFFER;
+    if (evts)
+    {
+        setvbuf(evts, NULL, _IOFBF, OUTPUT_BUFFER);
+        fwrite(EVENT_MAGIC, 1, 4, evts);
     }
-out:
-    free(stack);
+    if (pcm)
+    {
+        memset(&renderer, 0, sizeof(renderer));
+        renderer.pcm = pcm;
+        renderer.samples_per_hit = RENDER_RATE * 60 / tempo;
+        setvbuf(pcm, NULL, _IOFBF, OUTPUT_BUFFER);
+        out.renderer = &renderer;
+    }
+    memset(&ps, 0, sizeof(ps));
+    ps.state = S_IDLE;
+    ps.out = &out;
+    if (parse_file(inpt, &ps) == 0 && pcm)
+        render_finish(&renderer);
+
+    free(ps.note.marks);
+    free(out.buf);
     if (inpt != stdin)
         fclose(inpt);
     if (otpt != stdout)
         fclose(otpt);
+    if (evts)
+        fclose(evts);
+    if (pcm)
+    {
+        render_free(&renderer);
+        fclose(pcm);
+    }
     return 0;
 }
@@ -1,4 +1,10 @@
 /* Solve a quadratic equation */
+/* Batch mode: solve every equation in a CSV ("a,b,c" per line) or binary
+ * (three native doubles per equation) file. Real and complex roots are
+ * written to separate files, each line prefixed with the index of the
+ * equation. Build with -O3 -march=native -fopenmp -lm to get the AVX2/AVX-512
+ * kernels and multithreading.
+ */
 /*
  *  qm.c
  *  Copyright (C) 2017-2020 Zhang Maiyun <me@maiyun.me>
@@ -18,39 +24,466 @@
  */
 
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+/* Number of equations read, solved and written at a time */
+#define CHUNK 1048576
+/* Number of equations given to one thread at a time */
+#define BLOCK 4096
 
-int main()
+/* Structure-of-arrays buffers of a chunk */
+struct chunk
 {
-    double a, b, c, delta, x1, x2, real, imag;
+    double *a, *b, *c;
+    /* x1, x2 if real, real part, imaginary part if complex */
+    double *r1, *r2;
+    /* Non-zero if the roots are complex */
+    uint8_t *cplx;
+    size_t n;
+};
 
-    printf("Input three coefficients a, b, c: ");
-    fflush(stdout);
-    scanf("%lf %lf %lf", &a, &b, &c);
+/* Stable form of the roots:
+ *   q = -(b + sgn(b) sqrt(delta)) / 2, x1 = q / a, x2 = c / q,
+ * so -b and sqrt(delta) are never subtracted from each other */
+static void solve_scalar(const double *a, const double *b, const double *c,
+                         double *r1, double *r2, uint8_t *cplx, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+    {
+        double delta = b[i] * b[i] - 4 * a[i] * c[i];
+        double s = sqrt(fabs(delta));
+        if (delta >= 0)
+        {
+            double q = -0.5 * (b[i] + copysign(s, b[i]));
+            r1[i] = q / a[i];
+            /* b = c = 0 */
+            r2[i] = q == 0 ? r1[i] : c[i] / q;
+            cplx[i] = 0;
+        }
+        else
+        {
+            r1[i] = -b[i] / (2 * a[i]);
+            r2[i] = s / (2 * fabs(a[i]));
+            cplx[i] = 1;
+        }
+    }
+}
 
-    delta = b * b - 4 * a * c;
+#ifdef __AVX2__
+/* Same as solve_scalar, four equations at a time */
+static void solve_avx2(const double *a, const double *b, const double *c,
+                       double *r1, double *r2, uint8_t *cplx, size_t n)
+{
+    const __m256d half = _mm256_set1_pd(-0.5);
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m256d va = _mm256_loadu_pd(a + i);
+        __m256d vb = _mm256_loadu_pd(b + i);
+        __m256d vc = _mm256_loadu_pd(c + i);
+        __m256d delta = _mm256_sub_pd(_mm256_mul_pd(vb, vb),
+                                      _mm256_mul_pd(four, _mm256_mul_pd(va, vc)));
+        __m256d s = _mm256_sqrt_pd(_mm256_andnot_pd(sign, delta));
+        __m256d real = _mm256_cmp_pd(delta, zero, _CMP_GE_OQ);
+        /* Real roots */
+        __m256d q = _mm256_mul_pd(
+            half, _mm256_add_pd(
+                      vb, _mm256_or_pd(s, _mm256_and_pd(sign, vb))));
+        __m256d x1 = _mm256_div_pd(q, va);
+        __m256d x2 = _mm256_blendv_pd(_mm256_div_pd(vc, q), x1,
+                                      _mm256_cmp_pd(q, zero, _CMP_EQ_OQ));
+        /* Complex roots */
+        __m256d a2 = _mm256_mul_pd(two, va);
+        __m256d re = _mm256_div_pd(_mm256_xor_pd(sign, vb), a2);
+        __m256d im = _mm256_div_pd(s, _mm256_andnot_pd(sign, a2));
+        int mask = _mm256_movemask_pd(real);
+        _mm256_storeu_pd(r1 + i, _mm256_blendv_pd(re, x1, real));
+        _mm256_storeu_pd(r2 + i, _mm256_blendv_pd(im, x2, real));
+        cplx[i] = !(mask & 1);
+        cplx[i + 1] = !(mask & 2);
+        cplx[i + 2] = !(mask & 4);
+        cplx[i + 3] = !(mask & 8);
+    }
+    solve_scalar(a + i, b + i, c + i, r1 + i, r2 + i, cplx + i, n - i);
+}
+#endif
 
-    /* 两个不相等的实数根 */
-    if (delta > 0)
+#ifdef __AVX512F__
+/* Same as solve_scalar, eight equations at a time */
+static void solve_avx512(const double *a, const double *b, const double *c,
+                         double *r1, double *r2, uint8_t *cplx, size_t n)
+{
+    const __m512d half = _mm512_set1_pd(-0.5);
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512i sign = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8)
     {
-        x1 = (-b + sqrt(delta)) / (2 * a);
-        x2 = (-b - sqrt(delta)) / (2 * a);
-        printf("x1 = %.10lf, x2 = %.10lf\n", x1, x2);
+        __m512d va = _mm512_loadu_pd(a + i);
+        __m512d vb = _mm512_loadu_pd(b + i);
+        __m512d vc = _mm512_loadu_pd(c + i);
+        __m512d delta = _mm512_sub_pd(_mm512_mul_pd(vb, vb),
+                                      _mm512_mul_pd(four, _mm512_mul_pd(va, vc)));
+        __m512d s = _mm512_sqrt_pd(_mm512_abs_pd(delta));
+        __mmask8 real = _mm512_cmp_pd_mask(delta, zero, _CMP_GE_OQ);
+        /* copysign(s, b) */
+        __m512d ssign = _mm512_castsi512_pd(_mm512_or_si512(
+            _mm512_castpd_si512(s),
+            _mm512_and_si512(_mm512_castpd_si512(vb), sign)));
+        __m512d q = _mm512_mul_pd(half, _mm512_add_pd(vb, ssign));
+        __m512d x1 = _mm512_div_pd(q, va);
+        __m512d x2 =
+            _mm512_mask_blend_pd(_mm512_cmp_pd_mask(q, zero, _CMP_EQ_OQ),
+                                 _mm512_div_pd(vc, q), x1);
+        __m512d a2 = _mm512_mul_pd(two, va);
+        __m512d re = _mm512_div_pd(
+            _mm512_castsi512_pd(
+                _mm512_xor_si512(_mm512_castpd_si512(vb), sign)),
+            a2);
+        __m512d im = _mm512_div_pd(s, _mm512_abs_pd(a2));
+        int k;
+        _mm512_storeu_pd(r1 + i, _mm512_mask_blend_pd(real, re, x1));
+        _mm512_storeu_pd(r2 + i, _mm512_mask_blend_pd(real, im, x2));
+        for (k = 0; k < 8; ++k)
+            cplx[i + k] = !(real & (1 << k));
     }
-    /* 两个相等的实数根 */
-    else if (delta == 0)
+    solve_scalar(a + i, b + i, c + i, r1 + i, r2 + i, cplx + i, n - i);
+}
+#endif
+
+/* Best kernel for this build */
+static void solve_vector(const double *a, const double *b, const double *c,
+                         double *r1, double *r2, uint8_t *cplx, size_t n)
+{
+#if defined(__AVX512F__)
+    solve_avx512(a, b, c, r1, r2, cplx, n);
+#elif defined(__AVX2__)
+    solve_avx2(a, b, c, r1, r2, cplx, n);
+#else
+    solve_scalar(a, b, c, r1, r2, cplx, n);
+#endif
+}
+
+typedef void (*solver_t)(const double *, const double *, const double *,
+                         double *, double *, uint8_t *, size_t);
+
+/* Solve a chunk, split into blocks among threads */
+static void solve_chunk(struct chunk *ch, solver_t solver)
+{
+    long blk;
+    long nblk = (long)((ch->n + BLOCK - 1) / BLOCK);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (blk = 0; blk < nblk; ++blk)
     {
-        x1 = -b / (2 * a);
-        printf("x1 = x2 = %.10lf\n", x1);
+        size_t off = (size_t)blk * BLOCK;
+        size_t n = ch->n - off < BLOCK ? ch->n - off : BLOCK;
+        solver(ch->a + off, ch->b + off, ch->c + off, ch->r1 + off,
+               ch->r2 + off, ch->cplx + off, n);
     }
-    /* 复数根 */
-    else
+}
+
+static bool chunk_alloc(struct chunk *ch, size_t n)
+{
+    ch->a = malloc(sizeof(double) * n * 5);
+    ch->cplx = malloc(n);
+    if (!ch->a || !ch->cplx)
+    {
+        free(ch->a);
+        free(ch->cplx);
+        return false;
+    }
+    ch->b = ch->a + n;
+    ch->c = ch->b + n;
+    ch->r1 = ch->c + n;
+    ch->r2 = ch->r1 + n;
+    ch->n = 0;
+    return true;
+}
+
+static void chunk_free(struct chunk *ch)
+{
+    free(ch->a);
+    free(ch->cplx);
+}
+
+/* Read up to CHUNK equations. Returns false on a malformed line */
+static bool read_csv(FILE *in, struct chunk *ch, size_t *lineno)
+{
+    char line[256];
+    ch->n = 0;
+    while (ch->n < CHUNK && fgets(line, sizeof(line), in))
     {
-        real = -b / (2 * a);
-        imag = sqrt(-delta) / (2 * a);
-        printf("x1 = %.10lf+%.10lfi, x2 = %.10f-%.10fi\n", real, imag, real,
-               imag);
+        char *p = line, *end;
+        double v[3];
+        int k;
+        ++*lineno;
+        for (k = 0; k < 3; ++k)
+        {
+            while (*p == ' ' || *p == '\t' || (k && *p == ','))
+                ++p;
+            v[k] = strtod(p, &end);
+            if (end == p)
+            {
+                /* Blank lines are fine */
+                if (k == 0 && (*p == '\n' || *p == '\r' || *p == '\0'))
+                    break;
+                fprintf(stderr, "line %zu: expecting three numbers\n",
+                        *lineno);
+                return false;
+            }
+            p = end;
+        }
+        if (k < 3)
+            continue;
+        ch->a[ch->n] = v[0];
+        ch->b[ch->n] = v[1];
+        ch->c[ch->n] = v[2];
+        ++ch->n;
     }
+    return true;
+}
+
+/* Read up to CHUNK equations. Returns false on a truncated record */
+static bool read_binary(FILE *in, struct chunk *ch)
+{
+    double buf[3 * 1024];
+    size_t got, i;
+    ch->n = 0;
+    while (ch->n + 1024 <= CHUNK && (got = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        if (got % (sizeof(double) * 3))
+        {
+            fprintf(stderr, "input ends in a truncated record\n");
+            return false;
+        }
+        got /= sizeof(double) * 3;
+        for (i = 0; i < got; ++i)
+        {
+            ch->a[ch->n] = buf[3 * i];
+            ch->b[ch->n] = buf[3 * i + 1];
+            ch->c[ch->n] = buf[3 * i + 2];
+            ++ch->n;
+        }
+        if (got < 1024)
+            break;
+    }
+    return true;
+}
+
+/* Text output: "index,x1,x2" or "index,real,imag" */
+static void write_csv(const struct chunk *ch, size_t base, FILE *real,
+                      FILE *cplx)
+{
+    size_t i;
+    for (i = 0; i < ch->n; ++i)
+        fprintf(ch->cplx[i] ? cplx : real, "%zu,%.17g,%.17g\n", base + i,
+                ch->r1[i], ch->r2[i]);
+}
+
+/* Binary output: uint64_t index followed by the two doubles */
+static void write_binary(const struct chunk *ch, size_t base, FILE *real,
+                         FILE *cplx)
+{
+    size_t i;
+    for (i = 0; i < ch->n; ++i)
+    {
+        uint64_t idx = base + i;
+        FILE *out = ch->cplx[i] ? cplx : real;
+        fwrite(&idx, sizeof(idx), 1, out);
+        fwrite(ch->r1 + i, sizeof(double), 1, out);
+        fwrite(ch->r2 + i, sizeof(double), 1, out);
+    }
+}
+
+static int batch(const char *input, const char *real_path,
+                 const char *cplx_path, bool binary)
+{
+    FILE *in, *real, *cplx;
+    struct chunk ch;
+    size_t total = 0, lineno = 0;
+    int ret = 0;
+
+    in = strcmp(input, "-") == 0 ? stdin : fopen(input, binary ? "rb" : "r");
+    if (!in)
+    {
+        perror(input);
+        return 1;
+    }
+    real = fopen(real_path, binary ? "wb" : "w");
+    cplx = fopen(cplx_path, binary ? "wb" : "w");
+    if (!real || !cplx)
+    {
+        perror("fopen");
+        return 1;
+    }
+    if (!chunk_alloc(&ch, CHUNK))
+    {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    setvbuf(real, NULL, _IOFBF, 1 << 20);
+    setvbuf(cplx, NULL, _IOFBF, 1 << 20);
+
+    while (true)
+    {
+        if (!(binary ? read_binary(in, &ch) : read_csv(in, &ch, &lineno)))
+        {
+            ret = 1;
+            break;
+        }
+        if (ch.n == 0)
+            break;
+        solve_chunk(&ch, solve_vector);
+        if (binary)
+            write_binary(&ch, total, real, cplx);
+        else
+            write_csv(&ch, total, real, cplx);
+        total += ch.n;
+    }
+
+    chunk_free(&ch);
+    if (in != stdin)
+        fclose(in);
+    fclose(real);
+    fclose(cplx);
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Compare the kernels on n random equations */
+static int benchmark(size_t n)
+{
+    struct chunk ch;
+    size_t i;
+    double t;
+    if (!chunk_alloc(&ch, n))
+    {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < n; ++i)
+    {
+        ch.a[i] = (double)rand() / RAND_MAX * 200 - 100;
+        ch.b[i] = (double)rand() / RAND_MAX * 200 - 100;
+        ch.c[i] = (double)rand() / RAND_MAX * 200 - 100;
+    }
+    ch.n = n;
+    /* Fault the output pages in before timing anything */
+    solve_scalar(ch.a, ch.b, ch.c, ch.r1, ch.r2, ch.cplx, n);
+
+    t = now();
+    solve_scalar(ch.a, ch.b, ch.c, ch.r1, ch.r2, ch.cplx, n);
+    t = now() - t;
+    printf("scalar:           %8.2f M equations/s\n", n / t * 1e-6);
+#ifdef __AVX2__
+    t = now();
+    solve_avx2(ch.a, ch.b, ch.c, ch.r1, ch.r2, ch.cplx, n);
+    t = now() - t;
+    printf("AVX2:             %8.2f M equations/s\n", n / t * 1e-6);
+#endif
+#ifdef __AVX512F__
+    t = now();
+    solve_avx512(ch.a, ch.b, ch.c, ch.r1, ch.r2, ch.cplx, n);
+    t = now() - t;
+    printf("AVX-512:          %8.2f M equations/s\n", n / t * 1e-6);
+#endif
+    t = now();
+    solve_chunk(&ch, solve_vector);
+    t = now() - t;
+    printf("vector, threaded: %8.2f M equations/s\n", n / t * 1e-6);
+
+    chunk_free(&ch);
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s\n"
+           "       %s [-b] [-r REAL] [-c COMPLEX] INPUT\n"
+           "       %s -B COUNT\n"
+           "Without arguments, solve one equation interactively.\n\n"
+           "  -b          INPUT is binary (three doubles per equation)\n"
+           "  -r REAL     output for real roots [real.out]\n"
+           "  -c COMPLEX  output for complex roots [complex.out]\n"
+           "  -B COUNT    benchmark the solvers with COUNT equations\n"
+           "  -h          display this help and exit\n",
+           argv0, argv0, argv0);
+}
+
+int main(int argc, char **argv)
+{
+    double a, b, c, x1, x2;
+    uint8_t cplx;
+    const char *real_path = "real.out", *cplx_path = "complex.out";
+    bool binary = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "br:c:B:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                binary = true;
+                break;
+            case 'r':
+                real_path = optarg;
+                break;
+            case 'c':
+                cplx_path = optarg;
+                break;
+            case 'B':
+                return benchmark(strtoul(optarg, NULL, 0));
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        return batch(argv[optind], real_path, cplx_path, binary);
+
+    printf("Input three coefficients a, b, c: ");
+    fflush(stdout);
+    scanf("%lf %lf %lf", &a, &b, &c);
+
+    solve_scalar(&a, &b, &c, &x1, &x2, &cplx, 1);
+
+    /* 复数根 */
+    if (cplx)
+        printf("x1 = %.10lf+%.10lfi, x2 = %.10f-%.10fi\n", x1, x2, x1, x2);
+    /* 两个相等的实数根 */
+    else if (x1 == x2)
+        printf("x1 = x2 = %.10lf\n", x1);
+    /* 两个不相等的实数根 */
+    else
+        printf("x1 = %.10lf, x2 = %.10lf\n", x1, x2);
     getchar();
     return 0;
 }
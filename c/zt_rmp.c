@@ -21,11 +21,20 @@
 /* Command:
  *   x86_64-w64-mingw32-g++ -DADD_EXPORTS -DNW_ID=<network> \
  *   -DIDENTITY_SECRET=<identity.secret> -I libzt/include \ zt_rmp.c \
- *   lib/libzt.a -lws2_32 -lshlwapi -liphlpapi -lurlmon -lwinmm -static
+ *   lib/libzt.a -lws2_32 -lshlwapi -liphlpapi -lurlmon -lwinmm -lpthread \
+ *   -static
+ * On POSIX systems, with ZeroTier:
+ *   cc -DNW_ID=<network> -DIDENTITY_SECRET=<identity.secret> \
+ *   -I libzt/include zt_rmp.c lib/libzt.a -lpthread
+ * or with the system's sockets, listening on LADDR (127.0.0.1):
+ *   cc -DDISABLE_ZT zt_rmp.c -lpthread
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,10 +42,43 @@
 #ifdef WIN32
 #include <windows.h>
 #else
-#error Not Supported
+#include <unistd.h>
 #endif
 
+#ifdef DISABLE_ZT
+#ifdef WIN32
+#error DISABLE_ZT needs POSIX sockets
+#endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+#endif
+#else
 #include <ZeroTierSockets.h>
+#endif
+
+/* The sockets used, ZeroTier's or the system's */
+#ifdef DISABLE_ZT
+/* Writes to a closed peer fail instead of raising SIGPIPE */
+#define net_read(fd, buf, len) recv(fd, buf, len, 0)
+#define net_write(fd, buf, len) send(fd, buf, len, MSG_NOSIGNAL)
+#define net_close close
+#define net_errno errno
+#else
+#define net_read zts_read
+#define net_write zts_write
+#define net_close zts_close
+#define net_errno zts_errno
+#endif
+
+#ifndef LADDR
+#define LADDR "127.0.0.1"
+#endif
 
 #define ZT_WAITPOLL(stmt)                                                      \
     do                                                                         \
@@ -47,19 +89,70 @@
 
 const int LPORT = 9999;
 const int BACKLOG = 100;
+/* Threads handling commands; more connections wait in the queue */
+const int WORKERS = 8;
+const int QUEUE_LEN = 128;
+/* Connections accepted but yet to send anything, also kept below the limit
+ * on open files */
+const int MAX_IDLE = 1024;
+/* Seconds a connection may take to send its command */
+const int READ_TIMEOUT = 5;
 jmp_buf jmp_env;
 
-/* Create a ZeroTier socket, bind, and listen on it */
+/* Connections ready for the workers */
+struct conn_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int *fds;
+    int head;
+    int count;
+};
+
+static struct conn_queue queue = {PTHREAD_MUTEX_INITIALIZER,
+                                  PTHREAD_COND_INITIALIZER, NULL, 0, 0};
+
+/* Create a socket, bind, and listen on it */
 static int listen_socket(const char *laddr, int *pfd)
 {
     int fd;
     int err;
+#ifdef DISABLE_ZT
+    struct sockaddr_in addr;
+    const int one = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(LPORT);
+    if (inet_pton(AF_INET, laddr, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address: %s\n", laddr);
+        return 2;
+    }
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        fprintf(stderr, "Unable to create socket: errno=%d\n", errno);
+        return 2;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((err = bind(fd, (struct sockaddr *)&addr, sizeof(addr))) < 0)
+    {
+        fprintf(stderr, "Unable to bind: %d, errno=%d\n", err, errno);
+        close(fd);
+        return 2;
+    }
+    if ((err = listen(fd, BACKLOG)) < 0)
+    {
+        fprintf(stderr, "Unable to listen: %d, errno=%d\n", err, errno);
+        close(fd);
+        return 2;
+    }
+#else
     if ((fd = zts_socket(ZTS_AF_INET, ZTS_SOCK_STREAM, 0)) < 0)
     {
         fprintf(stderr, "Unable to create socket: zts_errno=%d\n", zts_errno);
         return 2;
     }
-    if ((err = zts_bind(fd, laddr, LPORT) < 0))
+    if ((err = zts_bind(fd, laddr, LPORT)) < 0)
     {
         fprintf(stderr, "Unable to bind: %d, zts_errno=%d\n", err, zts_errno);
         return 2;
@@ -70,12 +163,39 @@ static int listen_socket(const char *laddr, int *pfd)
                 zts_errno);
         return 2;
     }
+#endif
     printf("Listening on %s:%d\n", laddr, LPORT);
     *pfd = fd;
     return 0;
 }
 
-/* Read a line terminated with '\n' from ZeroTier file descriptor
+/* Accept a connection, which reads with a timeout so that a slow client
+ * cannot hold a worker */
+static int accept_socket(int fd)
+{
+    int accfd;
+#ifdef DISABLE_ZT
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct timeval timeout = {READ_TIMEOUT, 0};
+    char raddr[INET_ADDRSTRLEN] = {0};
+    if ((accfd = accept(fd, (struct sockaddr *)&addr, &len)) < 0)
+        return -1;
+    setsockopt(accfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    inet_ntop(AF_INET, &addr.sin_addr, raddr, sizeof(raddr));
+    printf("Connection from %s:%d\n", raddr, ntohs(addr.sin_port));
+#else
+    char raddr[ZTS_IP_MAX_STR_LEN] = {0};
+    unsigned short rport = 0;
+    if ((accfd = zts_accept(fd, raddr, ZTS_IP_MAX_STR_LEN, &rport)) < 0)
+        return -1;
+    zts_set_recv_timeout(accfd, READ_TIMEOUT, 0);
+    printf("Connection from %s:%d\n", raddr, rport);
+#endif
+    return accfd;
+}
+
+/* Read a line terminated with '\n' from a socket
  * Everything after the first newline is discarded */
 static char *read_command(int accfd)
 {
@@ -90,7 +210,7 @@ static char *read_command(int accfd)
         fprintf(stderr, "Unable to allocate command buffer\n");
         return NULL;
     }
-    while ((bytes = zts_read(accfd, buffer, sizeof(buffer))) >= 0)
+    while ((bytes = net_read(accfd, buffer, sizeof(buffer))) > 0)
     {
         char *newline;
         if (read + bytes >= allocated)
@@ -116,8 +236,9 @@ static char *read_command(int accfd)
 
         read += bytes;
     }
-    fprintf(stderr, "Unable to read from socket: %d, zts_errno=%d\n", bytes,
-            zts_errno);
+    if (bytes < 0)
+        fprintf(stderr, "Unable to read from socket: %d, errno=%d\n", bytes,
+                net_errno);
     free(command);
     return NULL;
 }
@@ -141,10 +262,13 @@ static int handle_play(const char *arg, int accfd)
             msg_back = "{\"play\": \"fail\"}";
     }
 
-    zts_write(accfd, msg_back, strlen(msg_back));
+    net_write(accfd, msg_back, strlen(msg_back));
     return ret;
 #else
-#error Not Supported
+    const char *msg_back = "{\"error\": \"not supported\"}";
+    (void)arg;
+    net_write(accfd, msg_back, strlen(msg_back));
+    return 1;
 #endif
 }
 
@@ -171,10 +295,14 @@ int handle_message(const char *arg, int accfd)
             msg_back = "{\"error\": \"unknown response\"}";
             break;
     }
-    zts_write(accfd, msg_back, strlen(msg_back));
+    net_write(accfd, msg_back, strlen(msg_back));
     return resp;
 #else
-#error Not Supported
+    /* No dialogs here, the message goes to the terminal */
+    const char *msg_back = "{\"response\": \"shown\"}";
+    printf("Message: %s\n", arg);
+    net_write(accfd, msg_back, strlen(msg_back));
+    return 0;
 #endif
 }
 
@@ -188,16 +316,12 @@ int handle_command(const char *arg, int accfd)
     if (output == NULL)
     {
         const char *msg_back = "{\"error\": \"execution failed\"}";
-        zts_write(accfd, msg_back, strlen(msg_back));
+        net_write(accfd, msg_back, strlen(msg_back));
         return 1;
     }
-    while (1)
-    {
-        size_t count = fread(buffer, sizeof(char), 128, output);
-        zts_write(accfd, buffer, count);
-        if (count < 128)
-            return 0;
-    }
+    while ((count = fread(buffer, sizeof(char), sizeof(buffer), output)) > 0)
+        net_write(accfd, buffer, count);
+    return pclose(output);
 }
 #endif
 
@@ -221,17 +345,292 @@ int run_command(char *command, int accfd)
     return 2;
 }
 
-/* Handle connections in a thread */
-void socket_thread(void *fd)
+/* Handle the command of a connection and close it */
+static void handle_connection(int accfd)
 {
-    char *command;
-    int accfd = (int)(intptr_t)fd;
-
-    command = read_command(accfd);
-    printf("Command returned %d\n", run_command(command, accfd));
+    char *command = read_command(accfd);
+    if (command)
+        printf("Command returned %d\n", run_command(command, accfd));
     free(command);
-    zts_close(accfd);
+    net_close(accfd);
+}
+
+/* Hand a connection to the workers. If they are too far behind it is
+ * turned away, so a flood costs neither threads nor memory */
+static void queue_connection(int accfd)
+{
+    const char *msg_back = "{\"error\": \"busy\"}";
+    pthread_mutex_lock(&queue.lock);
+    if (queue.count < QUEUE_LEN)
+    {
+        queue.fds[(queue.head + queue.count++) % QUEUE_LEN] = accfd;
+        pthread_cond_signal(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+    pthread_mutex_unlock(&queue.lock);
+#ifdef DISABLE_ZT
+    {
+        /* Unread input would turn the close into a reset that loses the
+         * reply */
+        char buffer[64];
+        while (recv(accfd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+            ;
+    }
+#endif
+    net_write(accfd, msg_back, strlen(msg_back));
+    net_close(accfd);
+}
+
+/* Handle queued connections, one at a time */
+static void *worker_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        int accfd;
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        accfd = queue.fds[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_LEN;
+        --queue.count;
+        pthread_mutex_unlock(&queue.lock);
+        handle_connection(accfd);
+    }
+    return NULL;
+}
+
+static int start_workers(void)
+{
+    int i, started = 0;
+#ifndef WIN32
+    sigset_t block, old;
+#endif
+    if (!(queue.fds = (int *)malloc(sizeof(int) * QUEUE_LEN)))
+    {
+        fprintf(stderr, "Unable to allocate connection queue\n");
+        return 2;
+    }
+#ifndef WIN32
+    /* jmp_end may only run on the main thread, so the workers inherit a
+     * mask without its signals */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+#endif
+    for (i = 0; i < WORKERS; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, NULL) != 0)
+        {
+            fprintf(stderr, "Unable to start thread: %d\n", errno);
+            continue;
+        }
+        pthread_detach(thread);
+        ++started;
+    }
+#ifndef WIN32
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+    return started ? 0 : 2;
+}
+
+#if defined(DISABLE_ZT) && defined(__linux__)
+struct idle_conn
+{
+    int fd;
+    long long deadline;
+    /* Neighbours in the list, or in the free list for unused slots */
+    int prev;
+    int next;
+};
+
+/* Connections waiting for their command, in the order they came so that
+ * the oldest is the first to time out */
+struct idle_list
+{
+    struct idle_conn *conns;
+    int max;
+    int count;
+    int oldest;
+    int newest;
+    int free;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int idle_init(struct idle_list *l)
+{
+    struct rlimit rl;
+    int i;
+    l->max = MAX_IDLE;
+    /* Leave room for the queue, the workers and the listening socket */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur < (rlim_t)MAX_IDLE + QUEUE_LEN + WORKERS + 16)
+        l->max = rl.rlim_cur > (rlim_t)QUEUE_LEN + WORKERS + 32
+                     ? (int)rl.rlim_cur - QUEUE_LEN - WORKERS - 16
+                     : 16;
+    if (!(l->conns = (struct idle_conn *)malloc(sizeof(struct idle_conn) *
+                                                l->max)))
+        return 1;
+    for (i = 0; i < l->max; ++i)
+        l->conns[i].next = i + 1 < l->max ? i + 1 : -1;
+    l->free = 0;
+    l->count = 0;
+    l->oldest = l->newest = -1;
+    return 0;
+}
+
+/* Track fd, returns its slot or -1 if the list is full */
+static int idle_add(struct idle_list *l, int fd)
+{
+    int i = l->free;
+    if (i < 0)
+        return -1;
+    l->free = l->conns[i].next;
+    l->conns[i].fd = fd;
+    l->conns[i].deadline = now_ms() + READ_TIMEOUT * 1000LL;
+    l->conns[i].prev = l->newest;
+    l->conns[i].next = -1;
+    if (l->newest >= 0)
+        l->conns[l->newest].next = i;
+    else
+        l->oldest = i;
+    l->newest = i;
+    ++l->count;
+    return i;
+}
+
+static void idle_remove(struct idle_list *l, int i)
+{
+    struct idle_conn *c = &l->conns[i];
+    if (c->prev >= 0)
+        l->conns[c->prev].next = c->next;
+    else
+        l->oldest = c->next;
+    if (c->next >= 0)
+        l->conns[c->next].prev = c->prev;
+    else
+        l->newest = c->prev;
+    c->next = l->free;
+    l->free = i;
+    --l->count;
+}
+
+/* Accept connections and queue each once its command starts to arrive,
+ * so that idle connections hold no worker. Those that stay silent for
+ * READ_TIMEOUT are closed */
+static void accept_loop(int fd)
+{
+    struct epoll_event ev, events[64];
+    struct idle_list idle;
+    /* While out of file descriptors the listening socket is not watched */
+    long long paused = 0;
+    int epfd, i, n;
+    if (idle_init(&idle) != 0)
+    {
+        fprintf(stderr, "Unable to allocate idle connections\n");
+        return;
+    }
+    if ((epfd = epoll_create1(0)) < 0)
+    {
+        fprintf(stderr, "Unable to create epoll: errno=%d\n", errno);
+        return;
+    }
+    /* Slots of idle connections are stored from 1, 0 is the listener */
+    ev.events = EPOLLIN;
+    ev.data.u32 = 0;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    while (1)
+    {
+        long long now = now_ms(), wake = -1;
+        while (idle.oldest >= 0 && idle.conns[idle.oldest].deadline <= now)
+        {
+            int accfd = idle.conns[idle.oldest].fd;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, accfd, NULL);
+            idle_remove(&idle, idle.oldest);
+            net_close(accfd);
+        }
+        if (paused && paused <= now)
+        {
+            ev.events = EPOLLIN;
+            ev.data.u32 = 0;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            paused = 0;
+        }
+        if (idle.oldest >= 0)
+            wake = idle.conns[idle.oldest].deadline;
+        if (paused && (wake < 0 || paused < wake))
+            wake = paused;
+        if ((n = epoll_wait(epfd, events, 64,
+                            wake < 0 ? -1 : (int)(wake - now))) < 0)
+        {
+            if (errno != EINTR)
+                fprintf(stderr, "Unable to wait: errno=%d\n", errno);
+            continue;
+        }
+        for (i = 0; i < n; ++i)
+        {
+            int accfd, slot = (int)events[i].data.u32 - 1;
+            if (slot >= 0)
+            {
+                /* Readable or closed, the worker finds out which */
+                accfd = idle.conns[slot].fd;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, accfd, NULL);
+                idle_remove(&idle, slot);
+                queue_connection(accfd);
+                continue;
+            }
+            if ((accfd = accept_socket(fd)) < 0)
+            {
+                fprintf(stderr, "Unable to accept connection: errno=%d\n",
+                        errno);
+                if (errno == EMFILE || errno == ENFILE)
+                {
+                    /* Level-triggered, it would be readable right away */
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                    paused = now_ms() + 100;
+                }
+                continue;
+            }
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            if ((slot = idle_add(&idle, accfd)) < 0)
+            {
+                queue_connection(accfd);
+                continue;
+            }
+            ev.data.u32 = slot + 1;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, accfd, &ev) != 0)
+            {
+                idle_remove(&idle, slot);
+                queue_connection(accfd);
+            }
+        }
+    }
 }
+#else
+static void accept_loop(int fd)
+{
+    while (1)
+    {
+        int accfd = accept_socket(fd);
+        if (accfd < 0)
+        {
+            fprintf(stderr, "Unable to accept connection: errno=%d\n",
+                    net_errno);
+            continue;
+        }
+        queue_connection(accfd);
+    }
+}
+#endif
 
 void jmp_end(int sig) { longjmp(jmp_env, sig); }
 
@@ -239,8 +638,12 @@ int main(void)
 {
     int fd = 0;
     int err;
+#ifdef DISABLE_ZT
+    const char *laddr = LADDR;
+#else
     char laddr[ZTS_IP_MAX_STR_LEN] = {0};
     const char identity[ZTS_ID_STR_BUF_LEN] = IDENTITY_SECRET;
+#endif
 
     /* Make the window disappear */
 #ifdef WIN32
@@ -255,10 +658,18 @@ int main(void)
         CloseHandle(h);
         FreeConsole();
     }
-#else
-#error Not Supported
 #endif
 
+#ifdef DISABLE_ZT
+    /* Set end-of-process handlers */
+    if (setjmp(jmp_env))
+    {
+        close(fd);
+        return 0;
+    }
+    signal(SIGINT, jmp_end);
+    signal(SIGTERM, jmp_end);
+#else
     if ((err = zts_init_from_memory(identity, ZTS_ID_STR_BUF_LEN)) !=
         ZTS_ERR_OK)
     {
@@ -298,31 +709,14 @@ int main(void)
     ZT_WAITPOLL(zts_addr_is_assigned(NW_ID, ZTS_AF_INET));
     zts_addr_get_str(NW_ID, ZTS_AF_INET, laddr, ZTS_IP_MAX_STR_LEN);
     printf("Assigned IP address: %s\n", laddr);
+#endif
 
+    if ((err = start_workers()) != 0)
+        return err;
     if ((err = listen_socket(laddr, &fd)) != 0)
         return err;
 
     /* Run indefinitely to accept commands */
-    while (1)
-    {
-        int accfd;
-        char raddr[ZTS_IP_MAX_STR_LEN] = {0};
-        unsigned short rport = 0;
-
-        accfd = zts_accept(fd, raddr, ZTS_IP_MAX_STR_LEN, &rport);
-        if (accfd < 0)
-        {
-            fprintf(stderr, "Unable to accept connection: zts_errno=%d\n",
-                    zts_errno);
-            continue;
-        }
-        printf("Connection from %s:%d\n", raddr, rport);
-#ifdef WIN32
-        if (_beginthread(&socket_thread, 0, (void *)(intptr_t)accfd) == -1)
-            fprintf(stderr, "Unable to start thread: %d\n", errno);
-#else
-#error Not Supported
-#endif
-    }
+    accept_loop(fd);
     return 127;
 }